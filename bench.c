@@ -0,0 +1,674 @@
+// Author: strawberryhacker
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "time.h"
+#include "utilities.h"
+#include "array.h"
+#include "disk.h"
+#include "exfat.h"
+#include "image.h"
+#include "trace.h"
+
+//--------------------------------------------------------------------------------------------------
+
+#define RANDOM_READ_SIZE    4096
+#define SEQUENTIAL_CHUNK    (64 * 1024)
+#define LIST_BATCH_SIZE     64
+#define APPEND_CHUNK        4096
+#define APPEND_COUNT        20
+
+//--------------------------------------------------------------------------------------------------
+
+define_array(sample_array, SampleArray, u64);
+
+typedef struct {
+    u64 reads;
+    u64 writes;
+    u64 block_reads;
+    u64 block_writes;
+    u64 sectors_read;
+    u64 sectors_written;
+} DiskCounters;
+
+typedef struct {
+    const char* name;
+    SampleArray samples;
+    DiskCounters start_counters;
+    u64 bytes;
+} Benchmark;
+
+typedef struct {
+    const char* name;
+    u32* value;
+    u64* value64;
+} Option;
+
+//--------------------------------------------------------------------------------------------------
+
+static Image image;
+static DiskCounters counters;
+static ImageConfig config;
+
+static u32 cache_size = DEFAULT_CACHE_SIZE;
+static int mount_flags = 0;
+static u32 iterations = 2000;
+static u64 random_state = 0x2545F4914F6CDD1DULL;
+
+//--------------------------------------------------------------------------------------------------
+
+static bool in_image(u64 address, u32 count) {
+    return (address + count) * config.sector_size <= image.size;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static bool memory_read(u64 address, u8* data) {
+    if (in_image(address, 1) == false) return false;
+
+    counters.reads++;
+    counters.sectors_read++;
+    memcpy(data, image.data + (u64)address * config.sector_size, config.sector_size);
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static bool memory_write(u64 address, const u8* data) {
+    if (in_image(address, 1) == false) return false;
+
+    counters.writes++;
+    counters.sectors_written++;
+    memcpy(image.data + (u64)address * config.sector_size, data, config.sector_size);
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static bool memory_read_blocks(u64 address, u32 count, u8* data) {
+    if (in_image(address, count) == false) return false;
+
+    counters.block_reads++;
+    counters.sectors_read += count;
+    memcpy(data, image.data + (u64)address * config.sector_size, (u64)count * config.sector_size);
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static bool memory_write_blocks(u64 address, u32 count, const u8* data) {
+    if (in_image(address, count) == false) return false;
+
+    counters.block_writes++;
+    counters.sectors_written += count;
+    memcpy(image.data + (u64)address * config.sector_size, data, (u64)count * config.sector_size);
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static DiskOps memory_ops = {
+    .read         = memory_read,
+    .write        = memory_write,
+    .read_blocks  = memory_read_blocks,
+    .write_blocks = memory_write_blocks,
+};
+
+//--------------------------------------------------------------------------------------------------
+
+static u64 get_time() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (u64)time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static u64 next_random() {
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return random_state * 0x2545F4914F6CDD1DULL;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static void fail(const char* what, int status) {
+    printf("error: %s failed with status %d\n", what, status);
+    exit(1);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Every benchmark gets its own mount, so it starts with a cold cache.
+static void mount_volume(char* mountpoint) {
+    Disk disk;
+
+    if (disk_read_partitions(&memory_ops, &disk) == false) {
+        fail("reading the partition table", EXFAT_DISK_ERROR);
+    }
+
+    int status = exfat_mount(&memory_ops, disk.partitions[0].address, mountpoint, cache_size, mount_flags);
+    if (status) fail("mounting", status);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static void begin_benchmark(Benchmark* benchmark, const char* name) {
+    benchmark->name = name;
+    benchmark->bytes = 0;
+    benchmark->start_counters = counters;
+    benchmark->samples.count = 0;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static inline void add_sample(Benchmark* benchmark, u64 start) {
+    sample_array_append(&benchmark->samples, get_time() - start);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static int compare_samples(const void* a, const void* b) {
+    u64 x = *(const u64 *)a;
+    u64 y = *(const u64 *)b;
+    return (x > y) - (x < y);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static double get_percentile(SampleArray* samples, int percent) {
+    int index = (int)(((u64)samples->count * percent + 99) / 100);
+    index = (index == 0) ? 0 : index - 1;
+    return samples->items[index] / 1000.0;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Throughput is based on the time spent inside the library calls, not on the time spent checking
+// the results.
+static void end_benchmark(Benchmark* benchmark) {
+    SampleArray* samples = &benchmark->samples;
+    DiskCounters* start = &benchmark->start_counters;
+
+    if (samples->count == 0) {
+        return;
+    }
+
+    u64 total = 0;
+
+    for (int i = 0; i < samples->count; i++) {
+        total += samples->items[i];
+    }
+
+    qsort(samples->items, samples->count, sizeof(u64), compare_samples);
+
+    double seconds = total / 1e9;
+
+    printf("%-22s %8d ops %10.3f ms %12.0f ops/s", benchmark->name, samples->count, total / 1e6, samples->count / seconds);
+
+    if (benchmark->bytes) {
+        printf(" %9.1f MB/s", benchmark->bytes / seconds / (1024 * 1024));
+    }
+    else {
+        printf("               ");
+    }
+
+    printf("  p50 %8.2f us  p90 %8.2f us  p99 %8.2f us  max %9.2f us", get_percentile(samples, 50), get_percentile(samples, 90), get_percentile(samples, 99), samples->items[samples->count - 1] / 1000.0);
+
+    printf("  read %lu read_blocks %lu sectors %lu write %lu write_blocks %lu\n",
+        (unsigned long)(counters.reads - start->reads),
+        (unsigned long)(counters.block_reads - start->block_reads),
+        (unsigned long)(counters.sectors_read - start->sectors_read),
+        (unsigned long)(counters.writes - start->writes),
+        (unsigned long)(counters.block_writes - start->block_writes));
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static void check_data(const u8* data, u64 offset, int size) {
+    for (int i = 0; i < size; i++) {
+        if (data[i] != image_file_byte(0, offset + i)) {
+            printf("error: wrong data at offset %lu\n", (unsigned long)(offset + i));
+            exit(1);
+        }
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static void bench_mount(Benchmark* benchmark) {
+    char mountpoint[32];
+
+    begin_benchmark(benchmark, "mount");
+
+    for (u32 i = 0; i < 20; i++) {
+        snprintf(mountpoint, sizeof(mountpoint), "mount%u", i);
+
+        u64 start = get_time();
+        mount_volume(mountpoint);
+        add_sample(benchmark, start);
+    }
+
+    end_benchmark(benchmark);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Both large.bin and fragmented.bin hold the data of file zero, so either can be read.
+static void bench_sequential_read(Benchmark* benchmark, char* mountpoint, const char* name, const char* filename, u64 size, int chunk) {
+    char path[64];
+    File file;
+
+    mount_volume(mountpoint);
+    snprintf(path, sizeof(path), "%s/%s", mountpoint, filename);
+
+    int status = exfat_open_file(&file, path);
+    if (status) fail("opening the file", status);
+
+    u8* data = malloc(chunk);
+    u64 offset = 0;
+
+    begin_benchmark(benchmark, name);
+
+    while (1) {
+        int read;
+
+        u64 start = get_time();
+        status = exfat_file_read(&file, data, chunk, &read);
+        add_sample(benchmark, start);
+
+        if (status) fail("reading the file", status);
+        if (read == 0) break;
+
+        check_data(data, offset, read);
+        offset += read;
+    }
+
+    benchmark->bytes = offset;
+    end_benchmark(benchmark);
+
+    if (offset != size) {
+        printf("error: read %lu bytes of %s\n", (unsigned long)offset, filename);
+        exit(1);
+    }
+
+    exfat_close(&file);
+    free(data);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static void bench_random_read(Benchmark* benchmark) {
+    static u8 data[RANDOM_READ_SIZE];
+    File file;
+
+    if (config.large_file_size < RANDOM_READ_SIZE) {
+        return;
+    }
+
+    mount_volume("random");
+
+    int status = exfat_open_file(&file, "random/large.bin");
+    if (status) fail("opening large.bin", status);
+
+    begin_benchmark(benchmark, "random seek 4K");
+
+    for (u32 i = 0; i < iterations; i++) {
+        u64 offset = next_random() % (config.large_file_size - RANDOM_READ_SIZE + 1);
+        int read;
+
+        u64 start = get_time();
+        status = exfat_set_file_offset(&file, offset);
+
+        if (status == EXFAT_OK) {
+            status = exfat_file_read(&file, data, RANDOM_READ_SIZE, &read);
+        }
+
+        add_sample(benchmark, start);
+
+        if (status) fail("reading large.bin", status);
+
+        check_data(data, offset, read);
+        benchmark->bytes += read;
+    }
+
+    end_benchmark(benchmark);
+    exfat_close(&file);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static void bench_list(Benchmark* benchmark, char* mountpoint, bool batched) {
+    static FileInfo infos[LIST_BATCH_SIZE];
+    char path[64];
+    File directory;
+
+    mount_volume(mountpoint);
+    snprintf(path, sizeof(path), "%s/wide", mountpoint);
+
+    int status = exfat_open_directory(&directory, path);
+    if (status) fail("opening wide", status);
+
+    begin_benchmark(benchmark, batched ? "list wide (batch)" : "list wide");
+
+    u32 entries = 0;
+
+    while (1) {
+        int count = 1;
+
+        u64 start = get_time();
+
+        if (batched) {
+            status = exfat_read_directory_batch(&directory, infos, FILE_INFO_ALL, LIST_BATCH_SIZE, &count);
+        }
+        else {
+            status = exfat_read_directory(&directory, infos);
+        }
+
+        add_sample(benchmark, start);
+
+        if (status == EXFAT_END_OF_FILE) break;
+        if (status) fail("listing wide", status);
+
+        entries += count;
+    }
+
+    end_benchmark(benchmark);
+    exfat_close(&directory);
+
+    if (entries != config.wide_count) {
+        printf("error: listed %u of %u entries\n", entries, config.wide_count);
+        exit(1);
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Looks up the leaf at the end of the deep chain over and over. The first lookup walks every
+// directory, and the following ones should mostly hit the dentry cache.
+static void bench_deep_lookup(Benchmark* benchmark) {
+    char path[1024];
+    File file;
+
+    mount_volume("deep");
+
+    int length = snprintf(path, sizeof(path), "deep/deep");
+
+    for (u32 i = 0; i < config.deep_depth && length < sizeof(path) - 16; i++) {
+        length += snprintf(path + length, sizeof(path) - length, "/d%02u", i);
+    }
+
+    snprintf(path + length, sizeof(path) - length, "/leaf.txt");
+
+    begin_benchmark(benchmark, "deep lookup");
+
+    for (u32 i = 0; i < iterations; i++) {
+        u64 start = get_time();
+        int status = exfat_open_file(&file, path);
+        add_sample(benchmark, start);
+
+        if (status) fail("opening the deep leaf", status);
+        exfat_close(&file);
+    }
+
+    end_benchmark(benchmark);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Number of directories in a subtree of /tree whose top is at the given level.
+static u32 get_subtree_size(u32 level) {
+    u32 size = 1;
+    u32 level_count = 1;
+
+    for (u32 i = level; i < config.depth; i++) {
+        level_count *= config.fan_out;
+        size += level_count;
+    }
+
+    return size;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Opens files spread over the whole tree by their full path, which mostly misses the caches. The
+// generator numbers the directories depth first and puts file i in directory i modulo their count.
+static void bench_tree_lookup(Benchmark* benchmark) {
+    char path[1024];
+    File file;
+
+    if (config.file_count == 0) {
+        return;
+    }
+
+    mount_volume("lookup");
+
+    u32 directory_count = get_subtree_size(0);
+
+    begin_benchmark(benchmark, "tree lookup");
+
+    for (u32 i = 0; i < iterations; i++) {
+        u32 file_number = next_random() % config.file_count;
+        u32 target = file_number % directory_count;
+        u32 number = 0;
+        u32 level = 0;
+
+        int length = snprintf(path, sizeof(path), "lookup/tree");
+
+        while (number != target) {
+            u32 subtree = get_subtree_size(level + 1);
+            u32 child = (target - number - 1) / subtree;
+
+            length += snprintf(path + length, sizeof(path) - length, "/dir_%03u", child);
+            number += 1 + child * subtree;
+            level++;
+        }
+
+        snprintf(path + length, sizeof(path) - length, "/file_%07u.dat", file_number);
+
+        u64 start = get_time();
+        int status = exfat_open_file(&file, path);
+        add_sample(benchmark, start);
+
+        if (status) fail(path, status);
+        exfat_close(&file);
+    }
+
+    end_benchmark(benchmark);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Streams small appends into the empty ingest files, one file after the other. Each file must stay
+// in one contiguous run, even when the volume has small free holes left by fragmented files.
+static void bench_stream_append(Benchmark* benchmark) {
+    static u8 data[APPEND_CHUNK];
+    char path[64];
+    File file;
+
+    mount_volume("append");
+    begin_benchmark(benchmark, "stream append 4K");
+
+    for (u32 i = 0; i < INGEST_FILE_COUNT; i++) {
+        snprintf(path, sizeof(path), "append/ingest_%u.bin", i);
+
+        int status = exfat_open_file(&file, path);
+        if (status) fail("opening an ingest file", status);
+
+        for (u32 j = 0; j < APPEND_COUNT; j++) {
+            u64 offset = (u64)j * APPEND_CHUNK;
+            int written;
+
+            for (int k = 0; k < APPEND_CHUNK; k++) {
+                data[k] = image_file_byte(0, offset + k);
+            }
+
+            u64 start = get_time();
+            status = exfat_file_write(&file, data, APPEND_CHUNK, &written);
+            add_sample(benchmark, start);
+
+            if (status) fail("appending to an ingest file", status);
+            benchmark->bytes += written;
+        }
+
+        status = exfat_flush(&file);
+        if (status) fail("flushing an ingest file", status);
+
+        if (file.no_fat_chain == false) {
+            printf("error: %s was split over several cluster runs\n", path);
+            exit(1);
+        }
+
+        exfat_close(&file);
+    }
+
+    end_benchmark(benchmark);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Prints the latency histograms of the operations seen during the whole run. Only available when
+// the library is built with EXFAT_TRACE.
+static void print_trace() {
+    if (trace_enabled() == false) {
+        return;
+    }
+
+    printf("\n");
+
+    for (int i = 0; i < TRACE_OPERATION_COUNT; i++) {
+        TraceHistogram histogram;
+        trace_get_histogram(i, &histogram);
+
+        if (histogram.count == 0) {
+            continue;
+        }
+
+        printf("%-22s %10lu ops  mean %9.2f us  p50 <= %8.2f us  p99 <= %8.2f us  max %9.2f us\n", trace_operation_name(i),
+            (unsigned long)histogram.count, histogram.total_time / 1000.0 / histogram.count, trace_percentile(&histogram, 50) / 1000.0,
+            trace_percentile(&histogram, 99) / 1000.0, histogram.max_time / 1000.0);
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static const char* usage =
+    "usage: bench [options]\n"
+    "  --sector-size n    --cluster-size n --files n       --fan-out n     --depth n\n"
+    "  --min-size n       --max-size n     --large-size n  --wide n\n"
+    "  --deep n           --fragmentation percent          --seed n        --fragmented-size n\n"
+    "  --cache bytes      --iterations n   --output path (write the image and exit)\n"
+    "  --verify (check the boot region and entry set checksums)\n";
+
+//--------------------------------------------------------------------------------------------------
+
+int main(int argument_count, const char** arguments) {
+    const char* output = 0;
+
+    image_default_config(&config);
+
+    Option options[] = {
+        { "--sector-size",   &config.sector_size,   0 },
+        { "--cluster-size",  &config.cluster_size,  0 },
+        { "--files",         &config.file_count,    0 },
+        { "--fan-out",       &config.fan_out,       0 },
+        { "--depth",         &config.depth,         0 },
+        { "--min-size",      &config.min_file_size, 0 },
+        { "--max-size",      &config.max_file_size, 0 },
+        { "--large-size",    0, &config.large_file_size },
+        { "--fragmented-size", 0, &config.fragmented_file_size },
+        { "--wide",          &config.wide_count,    0 },
+        { "--deep",          &config.deep_depth,    0 },
+        { "--fragmentation", &config.fragmentation, 0 },
+        { "--seed",          &config.seed,          0 },
+        { "--cache",         &cache_size,           0 },
+        { "--iterations",    &iterations,           0 },
+    };
+
+    for (int i = 1; i < argument_count; i++) {
+        bool found = false;
+
+        if (strcmp(arguments[i], "--output") == 0 && i + 1 < argument_count) {
+            output = arguments[++i];
+            continue;
+        }
+
+        if (strcmp(arguments[i], "--verify") == 0) {
+            mount_flags |= EXFAT_MOUNT_VERIFY;
+            continue;
+        }
+
+        for (int j = 0; j < sizeof(options) / sizeof(Option) && i + 1 < argument_count; j++) {
+            if (strcmp(arguments[i], options[j].name) == 0) {
+                u64 value = strtoull(arguments[++i], 0, 0);
+
+                if (options[j].value) {
+                    *options[j].value = value;
+                }
+                else {
+                    *options[j].value64 = value;
+                }
+
+                found = true;
+                break;
+            }
+        }
+
+        if (found == false) {
+            printf("%s", usage);
+            return 1;
+        }
+    }
+
+    u64 start = get_time();
+
+    if (image_generate(&config, &image) == false) {
+        printf("error: could not generate the image\n");
+        return 1;
+    }
+
+    printf("image: %lu MB, %u byte sectors, %u clusters of %u bytes, %u files, fan-out %u, depth %u, fragmentation %u%%, generated in %.1f ms\n",
+        (unsigned long)(image.size >> 20), config.sector_size, image.cluster_count, config.cluster_size, config.file_count, config.fan_out,
+        config.depth, config.fragmentation, (get_time() - start) / 1e6);
+
+    if (output) {
+        FILE* file = fopen(output, "wb");
+
+        if (file == 0 || fwrite(image.data, 1, image.size, file) != image.size) {
+            printf("error: could not write %s\n", output);
+            return 1;
+        }
+
+        fclose(file);
+        return 0;
+    }
+
+    exfat_init();
+    memory_ops.block_size = config.sector_size;
+
+    Benchmark benchmark;
+    sample_array_init(&benchmark.samples, 1024);
+
+    bench_mount(&benchmark);
+    bench_sequential_read(&benchmark, "sequential", "sequential read 64K", "large.bin", config.large_file_size, SEQUENTIAL_CHUNK);
+    bench_sequential_read(&benchmark, "small", "sequential read 4K", "large.bin", config.large_file_size, 4096);
+
+    // Readahead resolves the clusters ahead of the reads, which must not cost the reads their place
+    // in the cluster chain.
+    bench_sequential_read(&benchmark, "fragmented", "fragmented read 4K", "fragmented.bin", config.fragmented_file_size, 4096);
+    bench_random_read(&benchmark);
+    bench_list(&benchmark, "list", false);
+    bench_list(&benchmark, "batch", true);
+    bench_deep_lookup(&benchmark);
+    bench_tree_lookup(&benchmark);
+    bench_stream_append(&benchmark);
+    print_trace();
+
+    free(benchmark.samples.items);
+    image_free(&image);
+    return 0;
+}
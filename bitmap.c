@@ -0,0 +1,158 @@
+// Author: strawberryhacker
+
+#include "bitmap.h"
+
+//--------------------------------------------------------------------------------------------------
+
+typedef struct {
+    u32 run;
+    u32 largest;
+    u32 leading;
+    bool used_seen;
+} RunState;
+
+//--------------------------------------------------------------------------------------------------
+
+static inline void end_run(RunState* state) {
+    if (state->used_seen == false) {
+        state->leading = state->run;
+        state->used_seen = true;
+    }
+
+    if (state->run > state->largest) {
+        state->largest = state->run;
+    }
+
+    state->run = 0;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Counts the set bits in parallel within the word. __builtin_popcountll becomes a call into
+// libgcc unless the build targets a CPU with the POPCNT instruction, and this is just as fast
+// as that call.
+static inline u32 count_bits(u64 word) {
+    word = word - ((word >> 1) & 0x5555555555555555ull);
+    word = (word & 0x3333333333333333ull) + ((word >> 2) & 0x3333333333333333ull);
+    word = (word + (word >> 4)) & 0x0F0F0F0F0F0F0F0Full;
+    return (u32)((word * 0x0101010101010101ull) >> 56);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Walks the free runs inside a word which is neither completely free nor completely used. Only the
+// lowest width bits are looked at.
+static void scan_mixed_word(RunState* state, u64 free, u32 width) {
+    u32 position = 0;
+
+    while (position < width) {
+        u64 rest = free >> position;
+        u32 length;
+
+        if (rest & 1) {
+            length = (~rest == 0) ? 64 - position : __builtin_ctzll(~rest);
+            length = limit(length, width - position);
+            state->run += length;
+        }
+        else {
+            length = (rest == 0) ? width - position : __builtin_ctzll(rest);
+            length = limit(length, width - position);
+            end_run(state);
+        }
+
+        position += length;
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// A set bit in the allocation bitmap means that the cluster is in use. The bitmap is processed one
+// 64-bit word at a time, and words which are completely free or completely used are handled without
+// looking at individual bits.
+void bitmap_summarize(const u8* data, u32 bit_count, BitmapSummary* summary) {
+    RunState state = {0};
+
+    const u64* words = (const u64 *)data;
+    u32 word_count = bit_count / 64;
+    u32 free_count = 0;
+
+    for (u32 i = 0; i < word_count; i++) {
+        u64 free = ~words[i];
+
+        if (free == ~(u64)0) {
+            state.run += 64;
+            free_count += 64;
+        }
+        else if (free == 0) {
+            end_run(&state);
+        }
+        else {
+            free_count += count_bits(free);
+            scan_mixed_word(&state, free, 64);
+        }
+    }
+
+    u32 remaining = bit_count % 64;
+
+    if (remaining) {
+        u64 word = 0;
+        const u8* tail = data + word_count * 8;
+
+        for (u32 i = 0; i < (remaining + 7) / 8; i++) {
+            word |= (u64)tail[i] << (8 * i);
+        }
+
+        u64 free = ~word & (((u64)1 << remaining) - 1);
+
+        free_count += count_bits(free);
+        scan_mixed_word(&state, free, remaining);
+    }
+
+    summary->bits = bit_count;
+    summary->free = free_count;
+    summary->trailing = state.run;
+
+    end_run(&state);
+
+    summary->largest = state.largest;
+    summary->leading = state.leading;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Merges the chunk summaries. A free run can span several chunks, so the trailing run of one chunk
+// is joined with the leading run of the next.
+void bitmap_combine(const BitmapSummary* summaries, int count, u32* free, u32* largest) {
+    u32 run = 0;
+    u32 best = 0;
+    u32 total = 0;
+
+    for (int i = 0; i < count; i++) {
+        const BitmapSummary* summary = &summaries[i];
+        total += summary->free;
+
+        if (summary->leading == summary->bits) {
+            run += summary->bits;
+            continue;
+        }
+
+        run += summary->leading;
+
+        if (run > best) {
+            best = run;
+        }
+
+        if (summary->largest > best) {
+            best = summary->largest;
+        }
+
+        run = summary->trailing;
+    }
+
+    if (run > best) {
+        best = run;
+    }
+
+    *free = total;
+    *largest = best;
+}
@@ -0,0 +1,28 @@
+// Author: strawberryhacker
+
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include "utilities.h"
+
+//--------------------------------------------------------------------------------------------------
+
+#define BITMAP_CHUNK_SIZE  (16 * 1024)
+
+//--------------------------------------------------------------------------------------------------
+
+// Free space summary of one chunk of the allocation bitmap. Runs are counted in clusters.
+typedef struct {
+    u32 bits;
+    u32 free;
+    u32 largest;
+    u32 leading;
+    u32 trailing;
+} BitmapSummary;
+
+//--------------------------------------------------------------------------------------------------
+
+void bitmap_summarize(const u8* data, u32 bit_count, BitmapSummary* summary);
+void bitmap_combine(const BitmapSummary* summaries, int count, u32* free, u32* largest);
+
+#endif
@@ -0,0 +1,509 @@
+// Author: strawberryhacker
+
+#include "cache.h"
+#include "stdlib.h"
+#include "trace.h"
+
+//--------------------------------------------------------------------------------------------------
+
+static inline u32 hash_address(Cache* cache, u64 address) {
+    return (u32)(address * 0x9E3779B97F4A7C15ull >> 32) & cache->bucket_mask;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static void remove_from_bucket(Cache* cache, CacheBlock* block) {
+    CacheBlock** link = &cache->buckets[hash_address(cache, block->address)];
+
+    while (*link) {
+        if (*link == block) {
+            *link = block->next;
+            break;
+        }
+
+        link = &(*link)->next;
+    }
+
+    block->next = 0;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static void insert_in_bucket(Cache* cache, CacheBlock* block) {
+    CacheBlock** link = &cache->buckets[hash_address(cache, block->address)];
+    block->next = *link;
+    *link = block;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static CacheBlock* lookup(Cache* cache, u64 address) {
+    CacheBlock* block = cache->buckets[hash_address(cache, address)];
+
+    for (; block; block = block->next) {
+        if (block->address == address) {
+            return block;
+        }
+    }
+
+    return 0;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static bool write_back(Cache* cache, CacheBlock* block) {
+    if (block->valid && block->dirty) {
+        cache->stats.write_requests++;
+
+        u64 start = trace_begin(TRACE_DISK_WRITE);
+        bool success = cache->ops->write(block->address, block->data);
+        trace_end(TRACE_DISK_WRITE, start);
+
+        if (success == false) {
+            return false;
+        }
+
+        cache->stats.sector_writes++;
+
+        block->dirty = false;
+        cache->dirty_count--;
+    }
+
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// CLOCK eviction. Every block gets a second chance if it has been used since the hand last passed
+// it. Pinned blocks are never chosen. Returns zero if every block is pinned.
+static CacheBlock* find_victim(Cache* cache) {
+    for (int i = 0; i < 2 * cache->block_count; i++) {
+        CacheBlock* block = &cache->blocks[cache->clock_hand];
+
+        if (++cache->clock_hand == cache->block_count) {
+            cache->clock_hand = 0;
+        }
+
+        if (block->pin_count) {
+            continue;
+        }
+
+        if (block->valid && block->referenced) {
+            block->referenced = false;
+            continue;
+        }
+
+        return block;
+    }
+
+    return 0;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// The block size is the sector size of the volume, from BLOCK_SIZE to MAX_BLOCK_SIZE.
+bool cache_init(Cache* cache, DiskOps* ops, int size, u32 block_size) {
+    int block_count = size / block_size;
+
+    if (block_count < CACHE_MIN_BLOCKS) {
+        block_count = CACHE_MIN_BLOCKS;
+    }
+
+    u32 bucket_count = 1;
+    while (bucket_count < block_count) {
+        bucket_count <<= 1;
+    }
+
+    cache->ops         = ops;
+    cache->block_size  = block_size;
+    cache->block_count = block_count;
+    cache->bucket_mask = bucket_count - 1;
+    cache->clock_hand  = 0;
+    cache->dirty_count = 0;
+    cache->prefetching = false;
+    cache->prefetch_blocks = block_count / 4;
+    cache->blocks      = malloc(block_count * sizeof(CacheBlock));
+    cache->buckets     = malloc(bucket_count * sizeof(CacheBlock*));
+    cache->memory      = malloc(block_count * block_size);
+    cache->staging     = malloc(cache->prefetch_blocks * block_size);
+
+    if (cache->blocks == 0 || cache->buckets == 0 || cache->memory == 0 || cache->staging == 0) {
+        free(cache->blocks);
+        free(cache->buckets);
+        free(cache->memory);
+        free(cache->staging);
+        return false;
+    }
+
+    for (u32 i = 0; i < bucket_count; i++) {
+        cache->buckets[i] = 0;
+    }
+
+    cache->stats = (CacheStats){0};
+
+    for (int i = 0; i < block_count; i++) {
+        CacheBlock* block = &cache->blocks[i];
+
+        block->address    = 0;
+        block->valid      = false;
+        block->dirty      = false;
+        block->referenced = false;
+        block->overflow   = false;
+        block->pin_count  = 0;
+        block->next       = 0;
+        block->data       = cache->memory + i * block_size;
+    }
+
+    pthread_mutex_init(&cache->lock, 0);
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Frees a cache set up by cache_init. Dirty blocks are dropped, so the cache must be flushed first
+// if it has been written to.
+void cache_free(Cache* cache) {
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->blocks);
+    free(cache->buckets);
+    free(cache->memory);
+    free(cache->staging);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Empties a block chosen by find_victim so that it can take a new address. The caller fills in the
+// data and calls insert_block.
+static bool evict_block(Cache* cache, CacheBlock* block) {
+    if (write_back(cache, block) == false) {
+        return false;
+    }
+
+    if (block->valid) {
+        remove_from_bucket(cache, block);
+    }
+
+    block->valid = false;
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// With many threads reading at once, every block might be pinned. A block outside the cache is then
+// handed out instead, and freed when it is unpinned. Only readers get here, since a thread holding
+// a volume exclusively pins just a few blocks, so the block is never dirty.
+static CacheBlock* allocate_overflow_block(Cache* cache) {
+    CacheBlock* block = malloc(sizeof(CacheBlock) + cache->block_size);
+    if (block == 0) {
+        return 0;
+    }
+
+    block->address    = 0;
+    block->valid      = false;
+    block->dirty      = false;
+    block->referenced = false;
+    block->overflow   = true;
+    block->pin_count  = 0;
+    block->next       = 0;
+    block->data       = (u8 *)(block + 1);
+
+    return block;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static void insert_block(Cache* cache, CacheBlock* block, u64 address) {
+    block->address    = address;
+    block->valid      = true;
+    block->referenced = true;
+
+    if (block->overflow == false) {
+        insert_in_bucket(cache, block);
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Returns the block holding the sector at the given address, reading it from the disk on a miss.
+// The block is pinned and must be released with cache_unpin. The disk is read without holding the
+// lock, so misses from several threads are served in parallel.
+CacheBlock* cache_get(Cache* cache, u64 address) {
+    pthread_mutex_lock(&cache->lock);
+
+    CacheBlock* block = lookup(cache, address);
+
+    if (block) {
+        block->referenced = true;
+        block->pin_count++;
+        cache->stats.hits++;
+        pthread_mutex_unlock(&cache->lock);
+        return block;
+    }
+
+    cache->stats.misses++;
+    block = find_victim(cache);
+
+    if (block == 0) {
+        block = allocate_overflow_block(cache);
+    }
+    else if (evict_block(cache, block) == false) {
+        block = 0;
+    }
+
+    if (block == 0) {
+        pthread_mutex_unlock(&cache->lock);
+        return 0;
+    }
+
+    // The block is neither valid nor in a bucket, and the pin keeps other threads from taking it.
+    block->pin_count++;
+    pthread_mutex_unlock(&cache->lock);
+
+    u64 start = trace_begin(TRACE_DISK_READ);
+    bool success = cache->ops->read(address, block->data);
+    trace_end(TRACE_DISK_READ, start);
+
+    pthread_mutex_lock(&cache->lock);
+
+    cache->stats.read_requests++;
+    cache->stats.sector_reads += success ? 1 : 0;
+
+    // Another thread might have loaded the same sector in the meantime.
+    CacheBlock* other = lookup(cache, address);
+
+    if (success && other == 0) {
+        insert_block(cache, block, address);
+    }
+    else {
+        if (block->overflow) {
+            free(block);
+        }
+        else {
+            block->pin_count--;
+        }
+
+        block = 0;
+
+        if (success) {
+            block = other;
+            block->referenced = true;
+            block->pin_count++;
+        }
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+    return block;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Like cache_get, but never goes to the disk. Returns zero on a miss.
+CacheBlock* cache_find(Cache* cache, u64 address) {
+    pthread_mutex_lock(&cache->lock);
+
+    CacheBlock* block = lookup(cache, address);
+
+    if (block) {
+        block->referenced = true;
+        block->pin_count++;
+        cache->stats.hits++;
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+    return block;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Loads a range of sectors into the cache with a single multi-sector read. Sectors at either end of
+// the range which are already cached are left out of the request, and at most a quarter of the
+// cache is filled at a time so that prefetching does not push out everything else. Prefetching is
+// only a hint, so a request made while another thread is using the staging buffer is dropped.
+bool cache_prefetch(Cache* cache, u64 address, u32 count) {
+    count = limit(count, cache->prefetch_blocks);
+
+    pthread_mutex_lock(&cache->lock);
+
+    while (count && lookup(cache, address)) {
+        address++;
+        count--;
+    }
+
+    while (count && lookup(cache, address + count - 1)) {
+        count--;
+    }
+
+    if (count == 0 || cache->prefetching) {
+        pthread_mutex_unlock(&cache->lock);
+        return true;
+    }
+
+    if (cache->ops->read_blocks == 0) {
+        pthread_mutex_unlock(&cache->lock);
+
+        for (u32 i = 0; i < count; i++) {
+            CacheBlock* block = cache_get(cache, address + i);
+
+            if (block == 0) {
+                return false;
+            }
+
+            cache_unpin(cache, block);
+        }
+
+        return true;
+    }
+
+    cache->prefetching = true;
+    pthread_mutex_unlock(&cache->lock);
+
+    u64 start = trace_begin(TRACE_DISK_READ_BLOCKS);
+    bool success = cache->ops->read_blocks(address, count, cache->staging);
+    trace_end(TRACE_DISK_READ_BLOCKS, start);
+
+    pthread_mutex_lock(&cache->lock);
+
+    cache->stats.read_requests++;
+    cache->stats.sector_reads += success ? count : 0;
+
+    for (u32 i = 0; i < count && success; i++) {
+        // Cached copies in the middle of the range might hold changes which are not on
+        // the disk yet.
+        if (lookup(cache, address + i)) {
+            continue;
+        }
+
+        // Every block might be pinned by other threads, and the rest of the range is then dropped.
+        CacheBlock* block = find_victim(cache);
+
+        if (block == 0) {
+            break;
+        }
+
+        if (evict_block(cache, block) == false) {
+            success = false;
+            break;
+        }
+
+        // The whole run is copied under the lock, so a byte loop here would hold it far too long.
+        __builtin_memcpy(block->data, &cache->staging[i * cache->block_size], cache->block_size);
+
+        insert_block(cache, block, address + i);
+    }
+
+    cache->prefetching = false;
+    pthread_mutex_unlock(&cache->lock);
+
+    return success;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void cache_pin(Cache* cache, CacheBlock* block) {
+    pthread_mutex_lock(&cache->lock);
+    block->pin_count++;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void cache_unpin(Cache* cache, CacheBlock* block) {
+    pthread_mutex_lock(&cache->lock);
+
+    if (--block->pin_count == 0 && block->overflow) {
+        free(block);
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void cache_mark_dirty(Cache* cache, CacheBlock* block) {
+    pthread_mutex_lock(&cache->lock);
+
+    if (block->dirty == false) {
+        block->dirty = true;
+        cache->dirty_count++;
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+bool cache_flush(Cache* cache) {
+    bool success = true;
+
+    pthread_mutex_lock(&cache->lock);
+
+    for (int i = 0; i < cache->block_count && success; i++) {
+        success = write_back(cache, &cache->blocks[i]);
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+    return success;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Writes back dirty blocks in the address range. Used before sectors are read directly from
+// the disk. Each address is looked up in the hash, so the cost follows the range and not
+// the cache size.
+bool cache_flush_range(Cache* cache, u64 address, u32 count) {
+    bool success = true;
+
+    pthread_mutex_lock(&cache->lock);
+
+    for (u32 i = 0; i < count && cache->dirty_count && success; i++) {
+        CacheBlock* block = lookup(cache, address + i);
+
+        if (block) {
+            success = write_back(cache, block);
+        }
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+    return success;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Updates cached copies of sectors which have been written directly to the disk. The new data
+// replaces any pending changes in the cache.
+void cache_write_through(Cache* cache, u64 address, u32 count, const u8* data) {
+    pthread_mutex_lock(&cache->lock);
+
+    for (u32 i = 0; i < count; i++) {
+        CacheBlock* block = lookup(cache, address + i);
+
+        if (block == 0) {
+            continue;
+        }
+
+        __builtin_memcpy(block->data, &data[(u64)i * cache->block_size], cache->block_size);
+
+        if (block->dirty) {
+            block->dirty = false;
+            cache->dirty_count--;
+        }
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void cache_get_stats(Cache* cache, CacheStats* stats) {
+    pthread_mutex_lock(&cache->lock);
+    *stats = cache->stats;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void cache_reset_stats(Cache* cache) {
+    pthread_mutex_lock(&cache->lock);
+    cache->stats = (CacheStats){0};
+    pthread_mutex_unlock(&cache->lock);
+}
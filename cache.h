@@ -0,0 +1,81 @@
+// Author: strawberryhacker
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "utilities.h"
+#include "disk.h"
+#include "pthread.h"
+
+//--------------------------------------------------------------------------------------------------
+
+#define CACHE_MIN_BLOCKS  8
+
+//--------------------------------------------------------------------------------------------------
+
+typedef struct CacheBlock CacheBlock;
+
+struct CacheBlock {
+    u64 address;
+    bool valid;
+    bool dirty;
+    bool referenced;
+    bool overflow;
+    int  pin_count;
+
+    CacheBlock* next;
+    u8* data;
+};
+
+// Counted under the cache lock. A hit is a lookup served from memory, and a miss one which had to
+// read the disk. Sectors loaded by prefetching count as reads but not as misses.
+typedef struct {
+    u64 hits;
+    u64 misses;
+    u64 read_requests;
+    u64 write_requests;
+    u64 sector_reads;
+    u64 sector_writes;
+} CacheStats;
+
+// The cache can be used from several threads at once. A block handed out by cache_get or cache_find
+// is pinned, so its data stays in place until the caller unpins it.
+typedef struct {
+    DiskOps* ops;
+    pthread_mutex_t lock;
+    u32 block_size;
+
+    CacheBlock* blocks;
+    CacheBlock** buckets;
+    u8* memory;
+
+    // Multi-sector reads for prefetching land here before they are spread over the blocks.
+    u8* staging;
+    u32 prefetch_blocks;
+    bool prefetching;
+
+    CacheStats stats;
+
+    int block_count;
+    int dirty_count;
+    u32 bucket_mask;
+    int clock_hand;
+} Cache;
+
+//--------------------------------------------------------------------------------------------------
+
+bool cache_init(Cache* cache, DiskOps* ops, int size, u32 block_size);
+void cache_free(Cache* cache);
+CacheBlock* cache_get(Cache* cache, u64 address);
+CacheBlock* cache_find(Cache* cache, u64 address);
+bool cache_prefetch(Cache* cache, u64 address, u32 count);
+void cache_pin(Cache* cache, CacheBlock* block);
+void cache_unpin(Cache* cache, CacheBlock* block);
+void cache_mark_dirty(Cache* cache, CacheBlock* block);
+bool cache_flush(Cache* cache);
+bool cache_flush_range(Cache* cache, u64 address, u32 count);
+void cache_write_through(Cache* cache, u64 address, u32 count, const u8* data);
+void cache_get_stats(Cache* cache, CacheStats* stats);
+void cache_reset_stats(Cache* cache);
+
+#endif
@@ -3,6 +3,7 @@
 #include "cli.h"
 #include "stdio.h"
 #include "stdlib.h"
+#include "stdatomic.h"
 #include "exfat.h"
 
 //--------------------------------------------------------------------------------------------------
@@ -13,7 +14,11 @@ static int path_length = 5;
 
 static File file;
 static File dir;
-static FileInfo info;
+static FileInfo infos[16];
+
+static atomic_ullong walk_bytes;
+static atomic_uint walk_files;
+static atomic_uint walk_directories;
 
 //--------------------------------------------------------------------------------------------------
 
@@ -31,7 +36,7 @@ static bool is_delimiter(char c) {
 //--------------------------------------------------------------------------------------------------
 
 static void add_to_path_buffer(const char* data) {
-    if (data[0] == '.' && data[1] == '.') {
+    if (compare_string(data, "..")) {
         while (path_length && path_buffer[path_length - 1] != '/') {
             path_length--;
         }
@@ -58,33 +63,38 @@ static void print_directory(File* file) {
     };
 
     while (1) {
-        int status = exfat_read_directory(file, &info);
+        int count;
+        int status = exfat_read_directory_batch(file, infos, FILE_INFO_NAME | FILE_INFO_LENGTH | FILE_INFO_ATTRIBUTES | FILE_INFO_CREATE_TIME, sizeof(infos) / sizeof(FileInfo), &count);
         if (status == EXFAT_END_OF_FILE) break;
         if (status) exit(5);
 
-        char* post = "B";
-        u64 length = info.length;
-        if (length > 1000000000) {
-            length /= 1000000;
-            post = "MB";
-        }
-        else if (length > 1000000) {
-            length /= 1000;
-            post = "KB";
-        }
-
-        printf("%8ld %-2s ", length, post);
-        printf("%s %-2d, %4d  ", month_names[info.create_time.month], info.create_time.day, info.create_time.year);
-
-        if (info.attributes & FILE_ATTRIBUTES_DIRECTORY) {
-            printf("\033[46;30m");
+        for (int i = 0; i < count; i++) {
+            FileInfo* info = &infos[i];
+
+            char* post = "B";
+            u64 length = info->length;
+            if (length > 1000000000) {
+                length /= 1000000;
+                post = "MB";
+            }
+            else if (length > 1000000) {
+                length /= 1000;
+                post = "KB";
+            }
+
+            printf("%8ld %-2s ", length, post);
+            printf("%s %-2d, %4d  ", month_names[info->create_time.month], info->create_time.day, info->create_time.year);
+
+            if (info->attributes & FILE_ATTRIBUTES_DIRECTORY) {
+                printf("\033[46;30m");
+            }
+            else {
+                printf("\033[36;40m");
+            }
+
+            printf("%s", info->filename);
+            printf("\033[0m\n");
         }
-        else {
-            printf("\033[36;40m");
-        }
-
-        printf("%s", info.filename);
-        printf("\033[0m\n");
     }
 }
 
@@ -106,6 +116,21 @@ static void print_file(File* file) {
 
 //--------------------------------------------------------------------------------------------------
 
+// Called from several threads at once by exfat_walk.
+static int count_entry(const char* path, const FileInfo* info, u32 first_cluster, void* context) {
+    if (info->attributes & FILE_ATTRIBUTES_DIRECTORY) {
+        atomic_fetch_add(&walk_directories, 1);
+    }
+    else {
+        atomic_fetch_add(&walk_files, 1);
+        atomic_fetch_add(&walk_bytes, info->length);
+    }
+
+    return EXFAT_WALK_CONTINUE;
+}
+
+//--------------------------------------------------------------------------------------------------
+
 static void handle_input(char* data) {
     char* strings[100] = {0};
     int string_count = 0;
@@ -137,15 +162,26 @@ static void handle_input(char* data) {
             return;
         }
 
+        // There are no parent entries in exFAT, so going up is resolved from the root.
+        bool parent = compare_string(strings[1], "..");
+
         add_to_path_buffer(strings[1]);
-        int status = exfat_open_directory(&dir, path_buffer);
+
+        if (parent) {
+            exfat_close(&dir);
+        }
+
+        int status = parent ? exfat_open_directory(&dir, path_buffer) : exfat_open_directory_at(&dir, &dir, strings[1]);
 
         if (status) {
             add_to_path_buffer("..");
+            exfat_close(&dir);
+            exfat_open_directory(&dir, path_buffer);
             printf("exFAT error %i\n", status);
         }
     }
     else if (compare_string(strings[0], "list")) {
+        exfat_close(&dir);
         int status = exfat_open_directory(&dir, path_buffer);
 
         if (status) {
@@ -156,13 +192,93 @@ static void handle_input(char* data) {
     else if (compare_string(strings[0], "cat")) {
         if (strings[1] == 0) {
             printf("Wrong argument\n");
+            return;
+        }
+
+        int status = exfat_open_file_at(&dir, &file, strings[1]);
+
+        if (status) {
+            printf("exFAT error %i\n", status);
+            return;
         }
-        add_to_path_buffer(strings[1]);
-        exfat_open_file(&file, path_buffer);
-        add_to_path_buffer("..");
 
         print_file(&file);
         printf("\n");
+        exfat_close(&file);
+    }
+    else if (compare_string(strings[0], "append")) {
+        if (strings[1] == 0 || strings[2] == 0) {
+            printf("Wrong argument\n");
+            return;
+        }
+
+        int status = exfat_open_file_at(&dir, &file, strings[1]);
+
+        if (status == EXFAT_OK) {
+            status = exfat_set_file_offset(&file, file.file_length);
+        }
+
+        int written;
+        int length;
+        for (length = 0; strings[2][length]; length++);
+
+        if (status == EXFAT_OK) {
+            status = exfat_file_write(&file, strings[2], length, &written);
+        }
+
+        if (status == EXFAT_OK) {
+            status = exfat_flush(&file);
+        }
+
+        exfat_close(&file);
+
+        if (status) {
+            printf("exFAT error %i\n", status);
+        }
+    }
+    else if (compare_string(strings[0], "du")) {
+        int threads = strings[1] ? atoi(strings[1]) : 4;
+
+        atomic_store(&walk_bytes, 0);
+        atomic_store(&walk_files, 0);
+        atomic_store(&walk_directories, 0);
+
+        int status = exfat_walk(path_buffer, 0, count_entry, 0, threads);
+
+        if (status) {
+            printf("exFAT error %i\n", status);
+            return;
+        }
+
+        printf("%u files, %u directories, %llu bytes\n", atomic_load(&walk_files), atomic_load(&walk_directories), atomic_load(&walk_bytes));
+    }
+    else if (compare_string(strings[0], "stats")) {
+        if (strings[1] && compare_string(strings[1], "reset")) {
+            int status = exfat_reset_stats(path_buffer);
+
+            if (status) {
+                printf("exFAT error %i\n", status);
+            }
+            return;
+        }
+
+        ExFatStats stats;
+        int status = exfat_get_stats(path_buffer, &stats);
+
+        if (status) {
+            printf("exFAT error %i\n", status);
+            return;
+        }
+
+        printf("sectors read     %llu in %llu requests\n", (unsigned long long)stats.sector_reads, (unsigned long long)stats.read_requests);
+        printf("sectors written  %llu in %llu requests\n", (unsigned long long)stats.sector_writes, (unsigned long long)stats.write_requests);
+        printf("bytes read       %llu\n", (unsigned long long)stats.bytes_read);
+        printf("bytes written    %llu\n", (unsigned long long)stats.bytes_written);
+        printf("cache hits       %llu\n", (unsigned long long)stats.cache_hits);
+        printf("cache misses     %llu\n", (unsigned long long)stats.cache_misses);
+        printf("fat lookups      %llu\n", (unsigned long long)stats.fat_lookups);
+        printf("entries scanned  %llu\n", (unsigned long long)stats.entries_scanned);
+        printf("path lookups     %llu (%llu from the dentry cache)\n", (unsigned long long)stats.path_lookups, (unsigned long long)stats.dentry_hits);
     }
     else if (compare_string(strings[0], "clear")) {
         printf("\033[2J\033[0;0H");
@@ -174,6 +290,16 @@ static void handle_input(char* data) {
 
 //--------------------------------------------------------------------------------------------------
 
+void cli_init() {
+    int status = exfat_open_directory(&dir, path_buffer);
+
+    if (status) {
+        printf("exFAT error %i\n", status);
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+
 void cli_task() {    
     printf("\033[36m%.*s \033[0m:: ", path_length, path_buffer);
     void* status = fgets(input_buffer, 1024, stdin);
@@ -0,0 +1,209 @@
+// Author: strawberryhacker
+
+#include "dentry.h"
+#include "stdlib.h"
+
+//--------------------------------------------------------------------------------------------------
+
+static inline u32 hash_key(DentryCache* cache, u32 parent_cluster, u16 hash) {
+    return ((parent_cluster * 2654435761u) ^ hash) & cache->bucket_mask;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static void unlink_lru(DentryCache* cache, Dentry* dentry) {
+    if (dentry->newer) {
+        dentry->newer->older = dentry->older;
+    }
+    else {
+        cache->newest = dentry->older;
+    }
+
+    if (dentry->older) {
+        dentry->older->newer = dentry->newer;
+    }
+    else {
+        cache->oldest = dentry->newer;
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static void link_newest(DentryCache* cache, Dentry* dentry) {
+    dentry->newer = 0;
+    dentry->older = cache->newest;
+
+    if (cache->newest) {
+        cache->newest->newer = dentry;
+    }
+    else {
+        cache->oldest = dentry;
+    }
+
+    cache->newest = dentry;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static void unlink_bucket(DentryCache* cache, Dentry* dentry) {
+    Dentry** link = &cache->buckets[hash_key(cache, dentry->parent_cluster, dentry->name_hash)];
+
+    while (*link) {
+        if (*link == dentry) {
+            *link = dentry->next;
+            break;
+        }
+
+        link = &(*link)->next;
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+
+bool dentry_cache_init(DentryCache* cache, int capacity) {
+    u32 bucket_count = 1;
+    while (bucket_count < capacity) {
+        bucket_count <<= 1;
+    }
+
+    cache->entries     = malloc(capacity * sizeof(Dentry));
+    cache->buckets     = malloc(bucket_count * sizeof(Dentry*));
+    cache->bucket_mask = bucket_count - 1;
+    cache->newest      = 0;
+    cache->oldest      = 0;
+    cache->count       = 0;
+    cache->capacity    = capacity;
+
+    if (cache->entries == 0 || cache->buckets == 0) {
+        free(cache->entries);
+        free(cache->buckets);
+        cache->entries = 0;
+        return false;
+    }
+
+    for (u32 i = 0; i < bucket_count; i++) {
+        cache->buckets[i] = 0;
+    }
+
+    pthread_mutex_init(&cache->lock, 0);
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void dentry_cache_free(DentryCache* cache) {
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->entries);
+    free(cache->buckets);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// The lock must be held by the caller.
+static Dentry* find_name(DentryCache* cache, u32 parent_cluster, const Unicode* name, int length, u16 hash) {
+    Dentry* dentry = cache->buckets[hash_key(cache, parent_cluster, hash)];
+
+    for (; dentry; dentry = dentry->next) {
+        if (dentry->parent_cluster != parent_cluster || dentry->name_hash != hash || dentry->name_length != length) {
+            continue;
+        }
+
+        int i;
+        for (i = 0; i < length && dentry->name[i] == name[i]; i++);
+
+        if (i == length) {
+            return dentry;
+        }
+    }
+
+    return 0;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// The name must be up-cased. A hit is copied into the result, since the entry might be evicted by
+// another thread as soon as the lock is released, and becomes the most recently used one.
+bool dentry_lookup(DentryCache* cache, u32 parent_cluster, const Unicode* name, int length, u16 hash, Dentry* result) {
+    pthread_mutex_lock(&cache->lock);
+
+    Dentry* dentry = find_name(cache, parent_cluster, name, length, hash);
+
+    if (dentry) {
+        unlink_lru(cache, dentry);
+        link_newest(cache, dentry);
+        *result = *dentry;
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+    return dentry != 0;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Finds the entry describing the entry set at the given location. Used when a file has changed and
+// the cached copy of its stream has to be updated. The caller must have the volume to itself, since
+// the entry is changed after the lookup.
+Dentry* dentry_find_entry(DentryCache* cache, u32 parent_cluster, u16 hash, u64 entry_address, u32 entry_index) {
+    Dentry* dentry = cache->buckets[hash_key(cache, parent_cluster, hash)];
+
+    for (; dentry; dentry = dentry->next) {
+        if (dentry->parent_cluster == parent_cluster && dentry->entry_address == entry_address && dentry->entry_index == entry_index) {
+            return dentry;
+        }
+    }
+
+    return 0;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Records a resolved path component, evicting the least recently used entry if the cache is full.
+// The key is given by the parent cluster and the name, and the rest of the fields are copied from
+// the value. A name which is already cached is updated in place, since two threads may resolve the
+// same component at once.
+void dentry_insert(DentryCache* cache, u32 parent_cluster, const Unicode* name, int length, u16 hash, const Dentry* value) {
+    if (length > DENTRY_NAME_LENGTH) {
+        return;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+
+    Dentry* dentry = find_name(cache, parent_cluster, name, length, hash);
+
+    if (dentry) {
+        unlink_lru(cache, dentry);
+    }
+    else {
+        if (cache->count < cache->capacity) {
+            dentry = &cache->entries[cache->count++];
+        }
+        else {
+            dentry = cache->oldest;
+            unlink_lru(cache, dentry);
+            unlink_bucket(cache, dentry);
+        }
+
+        dentry->parent_cluster = parent_cluster;
+        dentry->name_hash = hash;
+        dentry->name_length = length;
+
+        for (int i = 0; i < length; i++) {
+            dentry->name[i] = name[i];
+        }
+
+        Dentry** bucket = &cache->buckets[hash_key(cache, parent_cluster, hash)];
+        dentry->next = *bucket;
+        *bucket = dentry;
+    }
+
+    dentry->entry_address = value->entry_address;
+    dentry->entry_index = value->entry_index;
+    dentry->attributes = value->attributes;
+    dentry->flags = value->flags;
+    dentry->first_cluster = value->first_cluster;
+    dentry->length = value->length;
+    dentry->valid_length = value->valid_length;
+
+    link_newest(cache, dentry);
+    pthread_mutex_unlock(&cache->lock);
+}
@@ -0,0 +1,63 @@
+// Author: strawberryhacker
+
+#ifndef DENTRY_H
+#define DENTRY_H
+
+#include "utilities.h"
+#include "pthread.h"
+
+//--------------------------------------------------------------------------------------------------
+
+#define DENTRY_CACHE_COUNT   128
+#define DENTRY_NAME_LENGTH   255
+
+//--------------------------------------------------------------------------------------------------
+
+typedef struct Dentry Dentry;
+
+// A resolved path component. Entries are keyed by the first cluster of the parent directory and the
+// up-cased name.
+struct Dentry {
+    u32 parent_cluster;
+    u16 name_hash;
+    u8  name_length;
+    Unicode name[DENTRY_NAME_LENGTH];
+
+    // Location of the primary directory entry.
+    u64 entry_address;
+    u32 entry_index;
+
+    u16 attributes;
+    u8  flags;
+    u32 first_cluster;
+    u64 length;
+    u64 valid_length;
+
+    Dentry* next;
+    Dentry* newer;
+    Dentry* older;
+};
+
+typedef struct {
+    pthread_mutex_t lock;
+
+    Dentry* entries;
+    Dentry** buckets;
+    u32 bucket_mask;
+
+    Dentry* newest;
+    Dentry* oldest;
+
+    int count;
+    int capacity;
+} DentryCache;
+
+//--------------------------------------------------------------------------------------------------
+
+bool dentry_cache_init(DentryCache* cache, int capacity);
+void dentry_cache_free(DentryCache* cache);
+bool dentry_lookup(DentryCache* cache, u32 parent_cluster, const Unicode* name, int length, u16 hash, Dentry* result);
+Dentry* dentry_find_entry(DentryCache* cache, u32 parent_cluster, u16 hash, u64 entry_address, u32 entry_index);
+void dentry_insert(DentryCache* cache, u32 parent_cluster, const Unicode* name, int length, u16 hash, const Dentry* value);
+
+#endif
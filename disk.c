@@ -2,11 +2,16 @@
 
 #include "disk.h"
 #include "stdio.h"
+#include "trace.h"
 
 //--------------------------------------------------------------------------------------------------
 
-#define MBR_SIGNATURE   0xAA55
-#define MBR_ADDRESS     0
+#define MBR_SIGNATURE       0xAA55
+#define MBR_ADDRESS         0
+#define GPT_HEADER_ADDRESS  1
+#define GPT_MIN_ENTRY_SIZE  128
+#define GPT_MAX_ENTRIES     1024
+#define GPT_CHUNK_SIZE      (16 * 1024)
 
 //--------------------------------------------------------------------------------------------------
 
@@ -21,16 +26,246 @@ typedef struct PACKED {
 
 typedef struct PACKED {
     u8 code[446];
-    PartitionEntry entries[PARTITION_COUNT];
+    PartitionEntry entries[MBR_PARTITION_COUNT];
     u16 signature;
 } MbrHeader;
 
+typedef struct PACKED {
+    char signature[8];
+    u32 revision;
+    u32 header_size;
+    u32 header_crc;
+    u32 reserved;
+    u64 current_address;
+    u64 backup_address;
+    u64 first_usable_address;
+    u64 last_usable_address;
+    u8  disk_guid[16];
+    u64 entries_address;
+    u32 entry_count;
+    u32 entry_size;
+    u32 entries_crc;
+} GptHeader;
+
+typedef struct PACKED {
+    u8  type_guid[16];
+    u8  partition_guid[16];
+    u64 first_address;
+    u64 last_address;
+    u64 attributes;
+    u16 name[36];
+} GptEntry;
+
+//--------------------------------------------------------------------------------------------------
+
+// EBD0A0A2-B9E5-4433-87C0-68B6B72699C7 as it is stored on the disk.
+static const u8 basic_data_guid[16] = {
+    0xA2, 0xA0, 0xD0, 0xEB, 0xE5, 0xB9, 0x33, 0x44, 0x87, 0xC0, 0x68, 0xB6, 0xB7, 0x26, 0x99, 0xC7,
+};
+
+//--------------------------------------------------------------------------------------------------
+
+static bool read_sector(DiskOps* ops, u64 address, u8* data) {
+    u64 start = trace_begin(TRACE_DISK_READ);
+    bool success = ops->read(address, data);
+    trace_end(TRACE_DISK_READ, start);
+
+    return success;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// The partition table is read in a few large requests when the disk supports them.
+static bool read_sectors(DiskOps* ops, u64 address, u32 count, u8* data, u32 block_size) {
+    if (ops->read_blocks) {
+        u64 start = trace_begin(TRACE_DISK_READ_BLOCKS);
+        bool success = ops->read_blocks(address, count, data);
+        trace_end(TRACE_DISK_READ_BLOCKS, start);
+
+        return success;
+    }
+
+    for (u32 i = 0; i < count; i++) {
+        if (read_sector(ops, address + i, data + i * block_size) == false) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// The CRC-32 used by GPT. The tables are small and only read at mount, so no lookup
+// table is needed.
+static u32 update_crc(u32 crc, const u8* data, u32 size) {
+    crc = ~crc;
+
+    for (u32 i = 0; i < size; i++) {
+        crc ^= data[i];
+
+        for (int j = 0; j < 8; j++) {
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+        }
+    }
+
+    return ~crc;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static bool compare_guid(const u8* a, const u8* b) {
+    for (int i = 0; i < 16; i++) {
+        if (a[i] != b[i]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static bool is_empty_guid(const u8* guid) {
+    for (int i = 0; i < 16; i++) {
+        if (guid[i]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
 //--------------------------------------------------------------------------------------------------
 
+// Reads the GPT header at the given address and checks its CRC.
+static bool read_gpt_header(DiskOps* ops, u64 address, u32 block_size, GptHeader* header) {
+    u8 data[MAX_BLOCK_SIZE];
+
+    if (read_sector(ops, address, data) == false) {
+        return false;
+    }
+
+    *header = *(GptHeader *)data;
+
+    const char* signature = "EFI PART";
+
+    for (int i = 0; i < 8; i++) {
+        if (header->signature[i] != signature[i]) {
+            return false;
+        }
+    }
+
+    if (header->header_size < sizeof(GptHeader) || header->header_size > block_size || header->current_address != address) {
+        return false;
+    }
+
+    u32 crc = header->header_crc;
+    ((GptHeader *)data)->header_crc = 0;
+
+    if (update_crc(0, data, header->header_size) != crc) {
+        return false;
+    }
+
+    u32 entry_size = header->entry_size;
+
+    if (entry_size < GPT_MIN_ENTRY_SIZE || entry_size > block_size || (entry_size & (entry_size - 1))) {
+        return false;
+    }
+
+    return header->entry_count > 0 && header->entry_count <= GPT_MAX_ENTRIES;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Reads the partition entries and checks their CRC. The partition count is only set when the whole
+// table is valid. Entries never straddle a sector, so the table can be walked a chunk of sectors at
+// a time.
+static bool read_gpt_entries(DiskOps* ops, GptHeader* header, u32 block_size, Disk* disk) {
+    u8 data[GPT_CHUNK_SIZE];
+
+    u32 entries_per_block = block_size / header->entry_size;
+    u32 block_count = (header->entry_count + entries_per_block - 1) / entries_per_block;
+    u32 chunk_blocks = GPT_CHUNK_SIZE / block_size;
+
+    int count = 0;
+    u32 crc = 0;
+    u32 entry = 0;
+
+    for (u32 block = 0; block < block_count; block += chunk_blocks) {
+        u32 blocks = limit(chunk_blocks, block_count - block);
+
+        if (read_sectors(ops, header->entries_address + block, blocks, data, block_size) == false) {
+            return false;
+        }
+
+        for (u32 offset = 0; offset < blocks * block_size && entry < header->entry_count; offset += header->entry_size, entry++) {
+            GptEntry* gpt_entry = (GptEntry *)(data + offset);
+            crc = update_crc(crc, data + offset, header->entry_size);
+
+            if (is_empty_guid(gpt_entry->type_guid) || count == PARTITION_COUNT) {
+                continue;
+            }
+
+            if (gpt_entry->first_address > gpt_entry->last_address) {
+                return false;
+            }
+
+            Partition* partition = &disk->partitions[count++];
+
+            // The basic data type does not tell exFAT apart from FAT or NTFS. That is left to the
+            // probe of the boot sector when the volume is mounted.
+            partition->status  = 0;
+            partition->type    = compare_guid(gpt_entry->type_guid, basic_data_guid) ? PARTITION_TYPE_BASIC_DATA : PARTITION_TYPE_OTHER;
+            partition->address = gpt_entry->first_address;
+            partition->size    = gpt_entry->last_address - gpt_entry->first_address + 1;
+
+            for (int i = 0; i < 16; i++) {
+                partition->type_guid[i] = gpt_entry->type_guid[i];
+            }
+        }
+    }
+
+    if (crc != header->entries_crc) {
+        return false;
+    }
+
+    disk->partition_count = count;
+    disk->gpt = true;
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// A protective MBR covers the whole disk, so the backup header is found at its last sector when the
+// primary one is damaged.
+static bool read_gpt(DiskOps* ops, const PartitionEntry* protective, Disk* disk) {
+    u32 block_size = ops->block_size ? ops->block_size : BLOCK_SIZE;
+    GptHeader header;
+
+    if (read_gpt_header(ops, GPT_HEADER_ADDRESS, block_size, &header) && read_gpt_entries(ops, &header, block_size, disk)) {
+        return true;
+    }
+
+    if (protective->size == 0xFFFFFFFF) {
+        return false;
+    }
+
+    u64 backup_address = (u64)protective->address + protective->size - 1;
+
+    return read_gpt_header(ops, backup_address, block_size, &header) && read_gpt_entries(ops, &header, block_size, disk);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Reads the MBR, or the GPT behind a protective MBR.
 bool disk_read_partitions(DiskOps* ops, Disk* disk) {
-    u8 data[BLOCK_SIZE];
+    disk->partition_count = 0;
+
+    // The MBR is at the start of the first sector, whatever its size.
+    u8 data[MAX_BLOCK_SIZE];
 
-    if (ops->read(MBR_ADDRESS, data) == false) {
+    if (read_sector(ops, MBR_ADDRESS, data) == false) {
         return false;
     }
 
@@ -40,12 +275,26 @@ bool disk_read_partitions(DiskOps* ops, Disk* disk) {
         return false;
     }
 
-    for (int i = 0; i < PARTITION_COUNT; i++) {
-        disk->partitions[i].status  = header->entries[i].status;
-        disk->partitions[i].type    = header->entries[i].type;
-        disk->partitions[i].address = header->entries[i].address;
-        disk->partitions[i].size    = header->entries[i].size;
+    for (int i = 0; i < MBR_PARTITION_COUNT; i++) {
+        if (header->entries[i].type == PARTITION_TYPE_GPT) {
+            return read_gpt(ops, &header->entries[i], disk);
+        }
+    }
+
+    for (int i = 0; i < MBR_PARTITION_COUNT; i++) {
+        Partition* partition = &disk->partitions[i];
+
+        partition->status  = header->entries[i].status;
+        partition->type    = header->entries[i].type;
+        partition->address = header->entries[i].address;
+        partition->size    = header->entries[i].size;
+
+        for (int j = 0; j < 16; j++) {
+            partition->type_guid[j] = 0;
+        }
     }
 
+    disk->partition_count = MBR_PARTITION_COUNT;
+    disk->gpt = false;
     return true;
 }
@@ -7,25 +7,58 @@
 
 //--------------------------------------------------------------------------------------------------
 
-#define PARTITION_COUNT  4
-#define BLOCK_SIZE       512
+#define MBR_PARTITION_COUNT  4
+#define PARTITION_COUNT      128
+#define BLOCK_SIZE           512
+#define MAX_BLOCK_SIZE       4096
 
 //--------------------------------------------------------------------------------------------------
 
+enum {
+    PARTITION_TYPE_EMPTY      = 0x00,
+    PARTITION_TYPE_EXFAT      = 0x07,
+    PARTITION_TYPE_GPT        = 0xEE,
+    PARTITION_TYPE_BASIC_DATA = 0xFE,
+    PARTITION_TYPE_OTHER      = 0xFF,
+};
+
+//--------------------------------------------------------------------------------------------------
+
+// A volume shared between threads calls these from several threads at once.
 typedef struct {
-    bool (*read)(u32 address, u8* data);
-    bool (*write)(u32 address, const u8* data);
+    // Size of the sectors which the addresses count, from BLOCK_SIZE to MAX_BLOCK_SIZE. Zero is
+    // taken as BLOCK_SIZE. A volume must use the same sector size as the medium it is on.
+    u32 block_size;
+
+    bool (*read)(u64 address, u8* data);
+    bool (*write)(u64 address, const u8* data);
+
+    // Optional multi-block transfers. If these are zero the single block functions
+    // are used instead.
+    bool (*read_blocks)(u64 address, u32 count, u8* data);
+    bool (*write_blocks)(u64 address, u32 count, const u8* data);
+
+    // Optional direct access to a medium which is mapped into memory. Returns a pointer to count
+    // consecutive sectors, or zero if they can not be mapped.
+    const u8* (*map)(u64 address, u32 count);
 } DiskOps;
 
+// GPT partitions of the Microsoft basic data type get PARTITION_TYPE_BASIC_DATA. The type is shared
+// by exFAT, FAT and NTFS, so only the boot sector tells what is on one. Other GPT partitions get
+// PARTITION_TYPE_OTHER, and their type GUID tells them apart.
 typedef struct {
     u8 status;
     u8 type;
-    u32 address;
-    u32 size;
+    u8 type_guid[16];
+    u64 address;
+    u64 size;
 } Partition;
 
+// An MBR fills in all four slots, with unused ones left empty. A GPT only lists the entries in use.
 typedef struct {
     Partition partitions[PARTITION_COUNT];
+    int partition_count;
+    bool gpt;
 } Disk;
 
 //--------------------------------------------------------------------------------------------------
@@ -1,16 +1,37 @@
 // Author: strawberryhacker
 
+// Reader-writer locks are part of POSIX, and are hidden by the C11 headers otherwise.
+#define _POSIX_C_SOURCE 200809L
+
 #include "exfat.h"
 #include "stdlib.h"
 #include "stdio.h"
 #include "array.h"
+#include "dentry.h"
+#include "bitmap.h"
+#include "unicode.h"
+#include "trace.h"
+#include "pthread.h"
+#include "stdatomic.h"
 
 //--------------------------------------------------------------------------------------------------
 
 #define EXFAT_PATH_DELIMITER  '/'
 
-#define CLUSTER_TO_FAT_ENTRY_SECTOR_SHIFT 7     // Divide by 128
-#define CLUSTER_TO_FAT_ENTRY_OFFSET_MASK  0x7F  // Modulo 128
+#define MIN_SECTOR_SHIFT      9
+#define MAX_SECTOR_SHIFT      12
+
+// The main boot region is eleven sectors covered by the checksum, followed by the checksum sector.
+#define BOOT_CHECKSUM_SECTOR  11
+
+#define UPCASE_TABLE_SIZE           0x10000
+#define UPCASE_TABLE_COMPRESSION    0xFFFF
+#define MAX_NAME_LENGTH             255
+#define VOLUME_LABEL_LENGTH         11
+#define ZERO_BLOCK_COUNT            16
+#define WALK_BATCH_SIZE             64
+#define WALK_QUEUE_SIZE             64
+#define MOUNT_MAX_THREADS           16
 
 define_array(exfat_array, ExFatArray, ExFat*);
 
@@ -30,6 +51,11 @@ enum {
     FAT_ENTRY_END_OF_CLUSTER_CHAIN_VALUE = 0xFFFFFFFF,
 };
 
+enum {
+    STREAM_FLAG_ALLOCATION_POSSIBLE = 1 << 0,
+    STREAM_FLAG_NO_FAT_CHAIN        = 1 << 1,
+};
+
 enum {
     ENTRY_FLAG_USED      = 1 << 7,
     ENTRY_FLAG_FREE      = 0 << 7,
@@ -100,7 +126,7 @@ typedef struct PACKED {
     u8 type;
     u8 reserved0[3];
     u32 checksum;
-    u8 reserved1[2];
+    u8 reserved1[12];
     u32 first_cluster;
     u64 length;
 } UpcaseTableEntry;
@@ -158,30 +184,176 @@ typedef union {
     NameEntry        name;
 } Entry;
 
+// Always-on counters. They are only ever added to, so relaxed atomics are enough even when the
+// volume lock is held shared.
+typedef struct {
+    atomic_ullong sector_reads;
+    atomic_ullong sector_writes;
+    atomic_ullong read_requests;
+    atomic_ullong write_requests;
+    atomic_ullong bytes_read;
+    atomic_ullong bytes_written;
+    atomic_ullong fat_lookups;
+    atomic_ullong entries_scanned;
+    atomic_ullong path_lookups;
+    atomic_ullong dentry_hits;
+} VolumeCounters;
+
 struct ExFat {
     DiskOps ops;
 
+    // Held shared by calls which only read from the volume, and exclusively by calls
+    // which change it.
+    pthread_rwlock_t lock;
+
     String mountpoint;
     char mountpoint_buffer[MOUNTPOINT_NAME_SIZE];
 
-    u32 volume_address_on_disk;
+    u64 volume_address_on_disk;
     ExFatInfo info;
 
-    u32 cluster_heap_address;
-    u32 fat_table_address;
+    u64 cluster_heap_address;
+    u64 fat_table_address;
 
     u32 cluster_offset_mask;
     u32 cluster_size;
+
+    // Sectors are from BLOCK_SIZE to MAX_BLOCK_SIZE bytes, as given by the boot sector. A FAT
+    // sector holds 2^fat_entry_shift entries.
+    u32 block_size;
+    u32 fat_entry_shift;
+
+    Cache cache;
+    DentryCache dentries;
+
+    // Characters at or above the up-case count map to themselves. When the table up-cases ASCII the
+    // usual way, ASCII names are compared without it.
+    Unicode* upcase_table;
+    u32 upcase_count;
+    bool ascii_upcase;
+
+    // The allocation bitmap is summarized in chunks. Only chunks which have changed since the last
+    // scan are read again.
+    File bitmap;
+    BitmapSummary* bitmap_chunks;
+    bool* bitmap_chunk_dirty;
+    int bitmap_chunk_count;
+
+    // The free cluster count is kept up to date as clusters are allocated, while the largest free
+    // run needs a rescan of the changed chunks.
+    bool free_valid;
+    bool space_valid;
+    u32 free_clusters;
+    u32 largest_free_run;
+
+    // Largest readahead window in bytes. Zero turns readahead off.
+    u32 readahead_max;
+
+    // Set by EXFAT_MOUNT_VERIFY. Entry sets with a wrong checksum are reported instead of used.
+    bool verify_checksums;
+
+    // Transfers which go through the cache are counted by the cache itself.
+    VolumeCounters counters;
 };
 
 typedef struct {
-    u32 window_address;
+    u64 window_address;
     u32 window_index;
+    CacheBlock* block;
 } SavedLocation;
 
+// A file name prepared for directory lookups. The name is up-cased so that it can be compared
+// against on-disk names without any further conversion of the search side.
+typedef struct {
+    Unicode name[MAX_NAME_LENGTH];
+    int length;
+    u16 hash;
+} SearchName;
+
+// A volume found by exfat_mount_all. The boot sector read by the probe is kept for the mount.
+typedef struct {
+    u64 address;
+    int status;
+    u8  boot_sector[MAX_BLOCK_SIZE];
+    char mountpoint[MOUNTPOINT_NAME_SIZE];
+} MountJob;
+
+typedef struct {
+    DiskOps* ops;
+    MountJob* jobs;
+    int job_count;
+    int cache_size;
+    int flags;
+    bool probing;
+    atomic_int next_job;
+} MountAll;
+
+// A directory waiting to be scanned by exfat_walk. The path is owned by the task.
+typedef struct {
+    char* path;
+    u32 first_cluster;
+    u64 length;
+    u8  flags;
+} WalkTask;
+
+// Tasks of one worker. The owner pushes and pops at the tail, so it goes depth first, while idle
+// workers steal from the head and get the directories closest to the root. The indexes only grow,
+// and the capacity is a power of two.
+typedef struct {
+    pthread_mutex_t lock;
+    WalkTask* tasks;
+    u32 head;
+    u32 tail;
+    u32 capacity;
+} WalkQueue;
+
+typedef struct {
+    FileInfo info;
+    u32 first_cluster;
+    u8  flags;
+} WalkEntry;
+
+typedef struct Walk Walk;
+
+typedef struct {
+    Walk* walk;
+    int index;
+    pthread_t thread;
+    WalkQueue queue;
+
+    // Entries are decoded in batches while the volume is held, and handed to the callback after it
+    // has been released.
+    WalkEntry entries[WALK_BATCH_SIZE];
+} WalkWorker;
+
+struct Walk {
+    ExFat* exfat;
+    ExFatWalkCallback callback;
+    void* context;
+    int fields;
+
+    WalkWorker* workers;
+    int worker_count;
+
+    // Pending counts the directories which are not done yet, and queued the ones waiting in a
+    // queue. The walk is over when nothing is pending.
+    atomic_int pending;
+    atomic_int queued;
+    atomic_int idle;
+    atomic_bool stop;
+
+    // Idle workers sleep on the condition until there is something to steal.
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int status;
+};
+
 //--------------------------------------------------------------------------------------------------
 
 static ExFatArray exfats;
+static pthread_rwlock_t exfats_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static const u8 zero_blocks[ZERO_BLOCK_COUNT * BLOCK_SIZE];
 
 static const u16 invalid_filename_characters[] = {
     0x0000, 0x0001, 0x0002, 0x0003, 0x0004, 0x0005, 0x0006, 0x0007,
@@ -220,7 +392,7 @@ static void print_header(ExFatHeader* header) {
 // @Cleanup: Remove.
 static void print_window_location(File* file) {
     printf("offset  :: %d\n", file->window_index);
-    printf("address :: %d\n", file->window_address);
+    printf("address :: %llu\n", (unsigned long long)file->window_address);
 }
 
 //--------------------------------------------------------------------------------------------------
@@ -294,6 +466,14 @@ static void memory_copy(const void* source, void* dest, int size) {
 
 //--------------------------------------------------------------------------------------------------
 
+static void memory_clear(void* dest, int size) {
+    for (int i = 0; i < size; i++) {
+        ((u8 *)dest)[i] = 0;
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+
 static String convert_to_string(char* data) {
     int i;
     for (i = 0; data[i]; i++);
@@ -322,20 +502,86 @@ static bool string_compare(String string1, String string2) {
 
 //--------------------------------------------------------------------------------------------------
 
-static int convert_to_unicode(char* string, Unicode* unicode, int length) {
-    int i;
-    for (i = 0; string[i] && i < length; i++) {
-         unicode[i] = (Unicode)string[i];
+static inline Unicode upcase(ExFat* exfat, Unicode c) {
+    return (c < exfat->upcase_count) ? exfat->upcase_table[c] : c;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// The name hash is computed over the up-cased name, low byte first.
+static u16 compute_name_hash(Unicode* name, int length) {
+    u16 hash = 0;
+
+    for (int i = 0; i < length; i++) {
+        hash = ((hash & 1) ? 0x8000 : 0) + (hash >> 1) + (name[i] & 0xFF);
+        hash = ((hash & 1) ? 0x8000 : 0) + (hash >> 1) + (name[i] >> 8);
     }
 
-    return i;
+    return hash;
 }
 
 //--------------------------------------------------------------------------------------------------
 
-static bool compare_unicode_filename(char* ascii, Unicode* unicode, int length) {
+static bool build_search_name(ExFat* exfat, String* filename, SearchName* search) {
+    int length = utf8_to_utf16(filename->text, filename->length, search->name, MAX_NAME_LENGTH);
+
+    if (length < 0) {
+        return false;
+    }
+
     for (int i = 0; i < length; i++) {
-        if (ascii[i] != (char)unicode[i]) {
+        search->name[i] = upcase(exfat, search->name[i]);
+    }
+
+    search->length = length;
+    search->hash = compute_name_hash(search->name, search->length);
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static inline u64 load_units(const Unicode* units) {
+    u64 value;
+    __builtin_memcpy(&value, units, sizeof(u64));
+    return value;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Up-cases four ASCII units at once. Adding 0x1F sets bit 7 of the units from 'a' and up,
+// and adding 0x05 those from '{' and up. No unit carries into the next one, since all of
+// them are below 0x80.
+static inline u64 upcase_ascii_units(u64 units) {
+    u64 from_a = units + 0x001F001F001F001FULL;
+    u64 above_z = units + 0x0005000500050005ULL;
+    u64 lower = (from_a & ~above_z) & 0x0080008000800080ULL;
+
+    return units - (lower >> 2);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// The search name is already up-cased. Runs of ASCII are compared four units at a time.
+static bool compare_unicode_filename(ExFat* exfat, Unicode* search, Unicode* unicode, int length) {
+    int i = 0;
+
+    if (exfat->ascii_upcase) {
+        for (; i + 4 <= length; i += 4) {
+            u64 expected = load_units(search + i);
+            u64 units = load_units(unicode + i);
+
+            if ((expected | units) & 0xFF80FF80FF80FF80ULL) {
+                break;
+            }
+
+            if (upcase_ascii_units(units) != expected) {
+                return false;
+            }
+        }
+    }
+
+    for (; i < length; i++) {
+        if (search[i] != upcase(exfat, unicode[i])) {
             return false;
         }
     }
@@ -389,47 +635,83 @@ static ExFat* get_volume_from_path(String* path) {
         return 0;
     }
 
+    ExFat* volume = 0;
+
+    pthread_rwlock_rdlock(&exfats_lock);
+
     for (int i = 0; i < exfats.count; i++) {
         if (string_compare(mountpoint, exfats.items[i]->mountpoint)) {
-            return exfats.items[i];
+            volume = exfats.items[i];
+            break;
         }
     }
 
-    return 0;
+    pthread_rwlock_unlock(&exfats_lock);
+    return volume;
 }
 
 //--------------------------------------------------------------------------------------------------
 
-static u32 cluster_to_address(ExFat* exfat, u32 cluster) {
-    return exfat->cluster_heap_address + ((cluster - 2) << exfat->info.sectors_per_cluster_shift);
+static u64 cluster_to_address(ExFat* exfat, u32 cluster) {
+    return exfat->cluster_heap_address + ((u64)(cluster - 2) << exfat->info.sectors_per_cluster_shift);
 }
 
 //--------------------------------------------------------------------------------------------------
 
-static u32 address_to_cluster(ExFat* exfat, u32 address) {
-    return ((address - exfat->cluster_heap_address) >> exfat->info.sectors_per_cluster_shift) + 2;
+static u32 address_to_cluster(ExFat* exfat, u64 address) {
+    return (u32)((address - exfat->cluster_heap_address) >> exfat->info.sectors_per_cluster_shift) + 2;
 }
 
 //--------------------------------------------------------------------------------------------------
 
-static int set_window_address(File* file, u32 new_address) {
-    if (file->window_valid && file->window_address == new_address) {
-        return EXFAT_OK;
+static inline void add_counter(atomic_ullong* counter, u64 value) {
+    atomic_fetch_add_explicit(counter, value, memory_order_relaxed);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static void reset_counters(VolumeCounters* counters) {
+    atomic_store_explicit(&counters->sector_reads, 0, memory_order_relaxed);
+    atomic_store_explicit(&counters->sector_writes, 0, memory_order_relaxed);
+    atomic_store_explicit(&counters->read_requests, 0, memory_order_relaxed);
+    atomic_store_explicit(&counters->write_requests, 0, memory_order_relaxed);
+    atomic_store_explicit(&counters->bytes_read, 0, memory_order_relaxed);
+    atomic_store_explicit(&counters->bytes_written, 0, memory_order_relaxed);
+    atomic_store_explicit(&counters->fat_lookups, 0, memory_order_relaxed);
+    atomic_store_explicit(&counters->entries_scanned, 0, memory_order_relaxed);
+    atomic_store_explicit(&counters->path_lookups, 0, memory_order_relaxed);
+    atomic_store_explicit(&counters->dentry_hits, 0, memory_order_relaxed);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// A valid window keeps its cache block pinned. Every public call releases the window before it
+// returns, so no block stays pinned while the handle is not in use.
+static void release_window(File* file) {
+    if (file->window_valid) {
+        cache_unpin(&file->exfat->cache, file->window);
+        file->window_valid = false;
     }
+}
 
-    if (file->window_valid && file->window_dirty) {
-        if (file->exfat->ops.write(file->window_address, file->window) == false) {
-            return EXFAT_DISK_ERROR;
-        }
+//--------------------------------------------------------------------------------------------------
 
-        file->window_dirty = false;
+// Makes sure the window references the cache block holding the current window address. The block
+// is shared by all files on the volume.
+static int cache_window(File* file) {
+    if (file->window_valid && file->window->address == file->window_address) {
+        return EXFAT_OK;
     }
 
-    if (file->exfat->ops.read(new_address, file->window) == false) {
+    release_window(file);
+
+    CacheBlock* block = cache_get(&file->exfat->cache, file->window_address);
+
+    if (block == 0) {
         return EXFAT_DISK_ERROR;
     }
 
-    file->window_address = new_address;
+    file->window = block;
     file->window_valid = true;
 
     return EXFAT_OK;
@@ -437,13 +719,67 @@ static int set_window_address(File* file, u32 new_address) {
 
 //--------------------------------------------------------------------------------------------------
 
+static int set_window_address(File* file, u64 new_address) {
+    file->window_address = new_address;
+    return cache_window(file);
+}
+
+//--------------------------------------------------------------------------------------------------
+
 static int sync_window(File* file) {
-    if (file->window_valid && file->window_dirty) {
-        if (file->exfat->ops.write(file->window_address, file->window) == false) {
+    if (cache_flush(&file->exfat->cache) == false) {
+        return EXFAT_DISK_ERROR;
+    }
+
+    return EXFAT_OK;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Moves the window to a new location without reading it. The block is fetched by cache_window if it
+// is ever needed.
+static void move_window_lazy(File* file, u64 new_address) {
+    release_window(file);
+
+    file->window_address = new_address;
+    file->window_index = 0;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Sectors read directly from the disk must not miss changes which are still in the cache.
+static int read_blocks(ExFat* exfat, u64 address, u32 count, u8* data) {
+    if (cache_flush_range(&exfat->cache, address, count) == false) {
+        return EXFAT_DISK_ERROR;
+    }
+
+    if (exfat->ops.read_blocks) {
+        add_counter(&exfat->counters.read_requests, 1);
+
+        u64 start = trace_begin(TRACE_DISK_READ_BLOCKS);
+        bool success = exfat->ops.read_blocks(address, count, data);
+        trace_end(TRACE_DISK_READ_BLOCKS, start);
+
+        if (success == false) {
+            return EXFAT_DISK_ERROR;
+        }
+
+        add_counter(&exfat->counters.sector_reads, count);
+        return EXFAT_OK;
+    }
+
+    for (u32 i = 0; i < count; i++) {
+        add_counter(&exfat->counters.read_requests, 1);
+
+        u64 start = trace_begin(TRACE_DISK_READ);
+        bool success = exfat->ops.read(address + i, data + i * exfat->block_size);
+        trace_end(TRACE_DISK_READ, start);
+
+        if (success == false) {
             return EXFAT_DISK_ERROR;
         }
 
-        file->window_dirty = false;
+        add_counter(&exfat->counters.sector_reads, 1);
     }
 
     return EXFAT_OK;
@@ -451,11 +787,36 @@ static int sync_window(File* file) {
 
 //--------------------------------------------------------------------------------------------------
 
-static int cache_window(File* file) {
-    file->window_valid = true;
+static int write_blocks(ExFat* exfat, u64 address, u32 count, const u8* data) {
+    cache_write_through(&exfat->cache, address, count, data);
 
-    if (file->exfat->ops.read(file->window_address, file->window) == false) {
-        return EXFAT_DISK_ERROR;
+    if (exfat->ops.write_blocks) {
+        add_counter(&exfat->counters.write_requests, 1);
+
+        u64 start = trace_begin(TRACE_DISK_WRITE_BLOCKS);
+        bool success = exfat->ops.write_blocks(address, count, data);
+        trace_end(TRACE_DISK_WRITE_BLOCKS, start);
+
+        if (success == false) {
+            return EXFAT_DISK_ERROR;
+        }
+
+        add_counter(&exfat->counters.sector_writes, count);
+        return EXFAT_OK;
+    }
+
+    for (u32 i = 0; i < count; i++) {
+        add_counter(&exfat->counters.write_requests, 1);
+
+        u64 start = trace_begin(TRACE_DISK_WRITE);
+        bool success = exfat->ops.write(address + i, data + i * exfat->block_size);
+        trace_end(TRACE_DISK_WRITE, start);
+
+        if (success == false) {
+            return EXFAT_DISK_ERROR;
+        }
+
+        add_counter(&exfat->counters.sector_writes, 1);
     }
 
     return EXFAT_OK;
@@ -464,86 +825,243 @@ static int cache_window(File* file) {
 //--------------------------------------------------------------------------------------------------
 
 static inline void* get_window_pointer(File* file) {
-    return &file->window[file->window_index];
+    return &file->window->data[file->window_index];
 }
 
 //--------------------------------------------------------------------------------------------------
 
 static int go_to_root_directory(File* file) {
     file->window_index = 0;
-    file->window_dirty = false;
 
     return set_window_address(file, cluster_to_address(file->exfat, file->exfat->info.root_cluster));
 }
 
 //--------------------------------------------------------------------------------------------------
 
-static int find_volume_and_rewind_to_root_directory(File* file, String* path) {
-    ExFat* volume = get_volume_from_path(path);
+// Points the file to the start of a new cluster chain. The window is not loaded.
+static void set_file_stream(File* file, u32 first_cluster, u64 length, u64 valid_length, u8 flags) {
+    file->file_address = cluster_to_address(file->exfat, first_cluster);
 
-    if (volume == 0) {
-        return EXFAT_WRONG_MOUNTPOINT_IN_PATH;
+    file->file_offset = 0;
+    file->file_length = length;
+    file->valid_length = valid_length;
+    file->file_cluster = first_cluster;
+    file->no_fat_chain = (flags & STREAM_FLAG_NO_FAT_CHAIN) != 0;
+
+    file->extent_count = 0;
+    file->cursor_index = 0;
+    file->cursor_cluster = first_cluster;
+    file->last_entry_valid = false;
+
+    // A stream only counts as sequential once a read continues where the previous one ended.
+    file->readahead_next = ~(u64)0;
+    file->readahead_end = 0;
+    file->readahead_size = 0;
+
+    move_window_lazy(file, file->file_address);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Every call made through the public interface holds the volume lock while it runs. The window of
+// the handle is released before the lock.
+static void enter_volume(ExFat* exfat, bool exclusive) {
+    if (exclusive) {
+        pthread_rwlock_wrlock(&exfat->lock);
+    }
+    else {
+        pthread_rwlock_rdlock(&exfat->lock);
     }
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static int leave_volume(File* file, int status) {
+    release_window(file);
 
-    // Initialize the exFAT structure.
+    add_counter(&file->exfat->counters.entries_scanned, file->entries_scanned);
+    file->entries_scanned = 0;
+
+    pthread_rwlock_unlock(&file->exfat->lock);
+    return status;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Initializes the handle to the root directory of the volume. The handle might not have been used
+// before, so nothing in it is released.
+static int rewind_to_root_directory(File* file, ExFat* volume) {
+    // Initialize the exFAT structure. The root directory always has a valid cluster chain.
     file->exfat = volume;
     file->window_valid = false;
+    file->map_copy = 0;
+    file->extra_extents = 0;
+    file->extra_capacity = 0;
+    file->entries_scanned = 0;
+    set_file_stream(file, volume->info.root_cluster, 0, 0, 0);
+    file->attributes = FILE_ATTRIBUTES_DIRECTORY;
 
     return go_to_root_directory(file);
 }
 
 //--------------------------------------------------------------------------------------------------
 
+// Finds the volume named by the start of the path and rewinds the file to its root directory. On
+// success the volume has been entered, and the caller must leave it.
+static int find_volume_and_rewind_to_root_directory(File* file, String* path, bool exclusive) {
+    ExFat* volume = get_volume_from_path(path);
+
+    if (volume == 0) {
+        return EXFAT_WRONG_MOUNTPOINT_IN_PATH;
+    }
+
+    enter_volume(volume, exclusive);
+
+    int status = rewind_to_root_directory(file, volume);
+    if (status) return leave_volume(file, status);
+
+    return EXFAT_OK;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// The block holding the saved location is pinned, so that restoring it does not have to go to the
+// disk. Every saved location must be released or restored.
 static void save_window_location(File* file, SavedLocation* location) {
     location->window_index = file->window_index;
     location->window_address = file->window_address;
+    location->block = file->window;
+
+    cache_pin(&file->exfat->cache, location->block);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static void release_window_location(File* file, SavedLocation* location) {
+    cache_unpin(&file->exfat->cache, location->block);
 }
 
 //--------------------------------------------------------------------------------------------------
 
 static int restore_window_location(File* file, SavedLocation* location) {
     file->window_index = location->window_index;
-    return set_window_address(file, location->window_address);
+    int status = set_window_address(file, location->window_address);
+
+    release_window_location(file, location);
+    return status;
 }
 
 //--------------------------------------------------------------------------------------------------
 
-static int increment_directory_offset(File* file, u64 increment) {
-    int status;
+// The FAT is read through the volume cache, so the file window is left untouched.
+static int get_next_cluster(ExFat* exfat, u32 cluster, u32* next_cluster) {
+    u32 fat_sector = cluster >> exfat->fat_entry_shift;
+    u32 fat_offset = cluster & ((1 << exfat->fat_entry_shift) - 1);
 
-    u32 cluster_size = file->exfat->cluster_size;
-    u32 current_cluster = address_to_cluster(file->exfat, file->window_address);
+    add_counter(&exfat->counters.fat_lookups, 1);
 
-    // Increment will now hold the number of bytes to jump relative to the start of the current cluster.
-    increment += file->window_index + ((file->window_address & file->exfat->cluster_offset_mask) * BLOCK_SIZE);
+    CacheBlock* block = cache_get(&exfat->cache, exfat->fat_table_address + fat_sector);
 
-    while (increment >= cluster_size) {
-        u32 fat_sector = current_cluster >> CLUSTER_TO_FAT_ENTRY_SECTOR_SHIFT;
-        u32 fat_offset = current_cluster & CLUSTER_TO_FAT_ENTRY_OFFSET_MASK;
+    if (block == 0) {
+        return EXFAT_DISK_ERROR;
+    }
 
-        status = set_window_address(file, file->exfat->fat_table_address + fat_sector);
-        if (status) return status;
+    u32 next = ((u32 *)block->data)[fat_offset];
+    cache_unpin(&exfat->cache, block);
+
+    if (next == FAT_ENTRY_BAD_CLUSTER_VALUE) {
+        return EXFAT_BAD_CLUSTER;
+    }
 
-        u32 next_cluster = ((u32 *)file->window)[fat_offset];
+    if (next == FAT_ENTRY_END_OF_CLUSTER_CHAIN_VALUE) {
+        return EXFAT_END_OF_CLUSTER_CHAIN;
+    }
 
-        if (next_cluster == FAT_ENTRY_BAD_CLUSTER_VALUE) {
-            return EXFAT_BAD_CLUSTER;
-        }
+    if (next < 2) {
+        return EXFAT_FREE_CLUSTER;
+    }
+
+    if (next >= exfat->info.cluster_count + 2) {
+        return EXFAT_BAD_CLUSTER;
+    }
+
+    *next_cluster = next;
+    return EXFAT_OK;
+}
+
+//--------------------------------------------------------------------------------------------------
 
-        if (next_cluster == FAT_ENTRY_END_OF_CLUSTER_CHAIN_VALUE) {
+static int set_fat_entry(ExFat* exfat, u32 cluster, u32 value) {
+    u32 fat_sector = cluster >> exfat->fat_entry_shift;
+    u32 fat_offset = cluster & ((1 << exfat->fat_entry_shift) - 1);
+
+    CacheBlock* block = cache_get(&exfat->cache, exfat->fat_table_address + fat_sector);
+
+    if (block == 0) {
+        return EXFAT_DISK_ERROR;
+    }
+
+    ((u32 *)block->data)[fat_offset] = value;
+    cache_mark_dirty(&exfat->cache, block);
+    cache_unpin(&exfat->cache, block);
+
+    return EXFAT_OK;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static u32 get_file_cluster_count(File* file) {
+    return (file->file_length + file->exfat->cluster_size - 1) / file->exfat->cluster_size;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Files marked with NoFatChain are stored in consecutive clusters, and their FAT entries are
+// undefined. The next cluster then follows from the cluster number alone.
+static int get_next_file_cluster(File* file, u32 cluster, u32* next_cluster) {
+    if (file->no_fat_chain) {
+        if (cluster + 1 >= file->file_cluster + get_file_cluster_count(file)) {
             return EXFAT_END_OF_CLUSTER_CHAIN;
         }
 
-        if (next_cluster < 2) {
-            return EXFAT_FREE_CLUSTER;
-        }
+        *next_cluster = cluster + 1;
+        return EXFAT_OK;
+    }
+
+    return get_next_cluster(file->exfat, cluster, next_cluster);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static int increment_directory_offset(File* file, u64 increment) {
+    int status;
+
+    file->entries_scanned += increment / sizeof(Entry);
+
+    u32 cluster_size = file->exfat->cluster_size;
+    u32 block_size = file->exfat->block_size;
+    u32 sector_in_cluster = file->window_address & file->exfat->cluster_offset_mask;
+
+    // Increment will now hold the number of bytes to jump relative to the start of the current cluster.
+    increment += file->window_index + (sector_in_cluster * block_size);
+
+    // Most moves stay inside the current cluster, and those do not need the cluster number at all.
+    if (increment < cluster_size) {
+        file->window_index = increment & (block_size - 1);
+        return set_window_address(file, file->window_address - sector_in_cluster + (u32)(increment >> file->exfat->info.bytes_per_sector_shift));
+    }
+
+    u32 current_cluster = address_to_cluster(file->exfat, file->window_address);
+
+    while (increment >= cluster_size) {
+        status = get_next_file_cluster(file, current_cluster, &current_cluster);
+        if (status) return status;
 
-        current_cluster = next_cluster;
         increment -= cluster_size;
     }
 
-    u32 new_address = cluster_to_address(file->exfat, current_cluster) + (u32)(increment >> file->exfat->info.bytes_per_sector_shift);
-    file->window_index = increment & (BLOCK_SIZE - 1);
+    u64 new_address = cluster_to_address(file->exfat, current_cluster) + (u32)(increment >> file->exfat->info.bytes_per_sector_shift);
+    file->window_index = increment & (block_size - 1);
     return set_window_address(file, new_address);
 }
 
@@ -556,6 +1074,9 @@ static int skip_directory_entries(File* file, int count) {
 //--------------------------------------------------------------------------------------------------
 
 static int move_window_to_primary_entry(u8 entry_type, File* file) {
+    int status = cache_window(file);
+    if (status) return status;
+
     while (1) {
         Entry* entry = get_window_pointer(file);
 
@@ -567,20 +1088,28 @@ static int move_window_to_primary_entry(u8 entry_type, File* file) {
             return EXFAT_END_OF_FILE;
         }
 
-        int status = increment_directory_offset(file, sizeof(Entry));
+        status = increment_directory_offset(file, sizeof(Entry));
+
+        // A directory does not need an end of directory entry if every entry is used.
+        if (status == EXFAT_END_OF_CLUSTER_CHAIN) {
+            return EXFAT_END_OF_FILE;
+        }
+
         if (status < 0) return status;
     }
 }
 
 //--------------------------------------------------------------------------------------------------
 
-static u16 compute_entry_checksum(u16 checksum, u8* entry, bool is_first) {
-    for (int i = 0; i < sizeof(Entry); i++) {
-        if (is_first && (i == 2 || i == 3)) {
-            continue;
-        }
+// Every step depends on the one before, so the checksum can not be split into lanes or looked up a
+// few bytes at a time. The loop is kept free of branches instead, and compiles to a rotate and an
+// add per byte. The checksum field of the primary entry is left out.
+static u16 compute_entry_checksum(u16 checksum, const u8* entry, bool is_first) {
+    checksum = (u16)((checksum >> 1) | (checksum << 15)) + entry[0];
+    checksum = (u16)((checksum >> 1) | (checksum << 15)) + entry[1];
 
-        checksum = ((checksum & 1) ? 0x8000 : 0) + (checksum >> 1) + (u16)entry[i];
+    for (int i = is_first ? 4 : 2; i < sizeof(Entry); i++) {
+        checksum = (u16)((checksum >> 1) | (checksum << 15)) + entry[i];
     }
 
     return checksum;
@@ -588,10 +1117,31 @@ static u16 compute_entry_checksum(u16 checksum, u8* entry, bool is_first) {
 
 //--------------------------------------------------------------------------------------------------
 
-// @Incomplete: We should do more tests here, including checking the state of the file system.
-static int verify_exfat_header(ExFatHeader* header) {
-    if (header->signature != 0xAA55) {
-        return EXFAT_BAD_HEADER_SIGNATURE;
+static u32 update_boot_checksum(u32 checksum, const u8* data, u32 from, u32 to) {
+    for (u32 i = from; i < to; i++) {
+        checksum = ((checksum >> 1) | (checksum << 31)) + data[i];
+    }
+
+    return checksum;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Checksum of the boot region, which leaves out the volume flags and the percent in use of the boot
+// sector, since these change while the volume is mounted.
+static u32 compute_boot_checksum(const u8* data, u32 block_size) {
+    u32 checksum = update_boot_checksum(0, data, 0, 106);
+    checksum = update_boot_checksum(checksum, data, 108, 112);
+    return update_boot_checksum(checksum, data, 113, BOOT_CHECKSUM_SECTOR * block_size);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// @Incomplete: We should do more tests here, including checking the state of the file system. The
+// volume must use the sector size of the medium, since the disk operations address whole sectors.
+static int verify_exfat_header(ExFatHeader* header, u32 block_size) {
+    if (header->signature != 0xAA55) {
+        return EXFAT_BAD_HEADER_SIGNATURE;
     }
 
     const char* exfat_string = "EXFAT   ";
@@ -602,12 +1152,140 @@ static int verify_exfat_header(ExFatHeader* header) {
         }
     }
 
+    u8 shift = header->info.bytes_per_sector_shift;
+
+    if (shift < MIN_SECTOR_SHIFT || shift > MAX_SECTOR_SHIFT || (1u << shift) != block_size) {
+        return EXFAT_SECTOR_SIZE_ERROR;
+    }
+
+    // The FATs and the cluster heap must fit inside the volume. Every sector the volume touches
+    // comes from one of them, as long as cluster numbers are checked against the cluster count.
+    ExFatInfo* info = &header->info;
+    u64 fat_end = info->fat_offset + (u64)info->fat_length * info->fat_count;
+    u64 heap_end = info->cluster_heap_offset + ((u64)info->cluster_count << info->sectors_per_cluster_shift);
+
+    if (info->fat_count == 0 || fat_end > info->volume_length || heap_end > info->volume_length) {
+        return EXFAT_NO_EXFAT_VOLUME;
+    }
+
+    return EXFAT_OK;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Adds the next count entries to the checksum and moves the window past them. Running into the end
+// of the directory after the last entry is not an error.
+static int checksum_directory_entries(File* file, int count, u16* checksum) {
+    for (int i = 0; i < count; i++) {
+        *checksum = compute_entry_checksum(*checksum, get_window_pointer(file), false);
+
+        int status = skip_directory_entries(file, 1);
+
+        if (status && i < count - 1) {
+            return (status == EXFAT_END_OF_CLUSTER_CHAIN) ? EXFAT_DIRECTORY_ENTRY_ERROR : status;
+        }
+    }
+
+    return EXFAT_OK;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Checks the checksum of the entry set at the current location. The window is left where it was.
+static int verify_entry_set(File* file) {
+    SavedLocation saved_location;
+    save_window_location(file, &saved_location);
+
+    DirectoryEntry* dir_entry = get_window_pointer(file);
+
+    u16 expected = dir_entry->checksum;
+    u16 checksum = compute_entry_checksum(0, (u8 *)dir_entry, true);
+    int secondary_count = dir_entry->secondary_count;
+
+    int status = skip_directory_entries(file, 1);
+
+    if (status == EXFAT_OK) {
+        status = checksum_directory_entries(file, secondary_count, &checksum);
+    }
+    else if (status == EXFAT_END_OF_CLUSTER_CHAIN) {
+        status = EXFAT_DIRECTORY_ENTRY_ERROR;
+    }
+
+    if (status) {
+        release_window_location(file, &saved_location);
+        return status;
+    }
+
+    status = restore_window_location(file, &saved_location);
+    if (status) return status;
+
+    return (checksum == expected) ? EXFAT_OK : EXFAT_CHECKSUM_ERROR;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Compares the name in the entry set at the current location against the search name. Entry sets
+// with a different name length or name hash are skipped without looking at the name entries. The
+// window is left somewhere inside the entry set, or on the next entry set.
+static int compare_entry_set_name(File* file, SearchName* search, bool* match) {
+    DirectoryEntry* dir_entry = get_window_pointer(file);
+
+    int secondary_count = dir_entry->secondary_count;
+    *match = false;
+
+    if (secondary_count < 2) {
+        return EXFAT_WRONG_SECONDARY_ENTRY_COUNT;
+    }
+
+    int status = skip_directory_entries(file, 1);
+    if (status) return status;
+
+    StreamEntry* stream = get_window_pointer(file);
+
+    int name_length = stream->name_length;
+
+    if (name_length != search->length || stream->name_checksum != search->hash) {
+        return skip_directory_entries(file, secondary_count);
+    }
+
+    status = skip_directory_entries(file, 1);
+    if (status) return status;
+
+    // Skip the stream entry.
+    secondary_count--;
+
+    Unicode* name_pointer = search->name;
+
+    // Check if the name matches.
+    while (secondary_count-- && name_length) {
+        NameEntry* entry = get_window_pointer(file);
+
+        if (entry->type != ENTRY_TYPE_NAME) {
+            return EXFAT_NAME_ENTRY_DOES_NOT_EXIST;
+        }
+
+        int length = limit(name_length, NAME_ENTRY_CHARACTERS);
+
+        if (compare_unicode_filename(file->exfat, name_pointer, entry->name, length) == false) {
+            return EXFAT_OK;
+        }
+
+        name_length -= length;
+        name_pointer += length;
+
+        if (name_length) {
+            status = skip_directory_entries(file, 1);
+            if (status) return status;
+        }
+    }
+
+    *match = (name_length == 0);
     return EXFAT_OK;
 }
 
 //--------------------------------------------------------------------------------------------------
 
-static int find_file_in_current_directory(File* file, String* filename) {
+static int find_file_in_current_directory(File* file, SearchName* search) {
     SavedLocation saved_location;
 
     while (1) {
@@ -618,113 +1296,200 @@ static int find_file_in_current_directory(File* file, String* filename) {
         // We are only interested in the location of the first entry.
         save_window_location(file, &saved_location);
 
-        DirectoryEntry* dir_entry = get_window_pointer(file);
+        bool match;
+        status = compare_entry_set_name(file, search, &match);
 
-        int secondary_count = dir_entry->secondary_count;
-        u16 checksum = dir_entry->checksum;
-        u16 attributes = dir_entry->attributes;
+        if (status == EXFAT_OK && match) {
+            status = restore_window_location(file, &saved_location);
+
+            if (status == EXFAT_OK && file->exfat->verify_checksums) {
+                status = verify_entry_set(file);
+            }
 
-        if (dir_entry->secondary_count < 2) {
-            return EXFAT_WRONG_SECONDARY_ENTRY_COUNT;
+            return status;
+        }
+
+        release_window_location(file, &saved_location);
+
+        // The last entry set might end exactly where the directory does.
+        if (status == EXFAT_END_OF_CLUSTER_CHAIN) {
+            return EXFAT_END_OF_FILE;
         }
 
-        status = skip_directory_entries(file, 1);
         if (status) return status;
+    }
+}
 
-        StreamEntry* stream = get_window_pointer(file);
+//--------------------------------------------------------------------------------------------------
+
+// Checks if the entry set at the current location has the given name. If not, the window is moved
+// back to the start of the directory.
+static int check_entry_set_hint(File* file, SearchName* search, bool* match) {
+    SavedLocation saved_location;
+    save_window_location(file, &saved_location);
 
-        u8 name_length = stream->name_length;
-        u16 name_checksum = stream->name_checksum;
+    int status = compare_entry_set_name(file, search, match);
 
-        if (name_length != filename->length) {
-            continue;
+    if (status == EXFAT_OK && *match) {
+        status = restore_window_location(file, &saved_location);
+
+        if (status == EXFAT_OK && file->exfat->verify_checksums) {
+            status = verify_entry_set(file);
         }
 
-        status = skip_directory_entries(file, 1);
-        if (status) return status;
+        return status;
+    }
 
-        // Skip the stream entry.
-        secondary_count--;
+    release_window_location(file, &saved_location);
+    move_window_lazy(file, file->file_address);
 
-        char* name_pointer = filename->text;
-        bool match = true;
+    return (status == EXFAT_END_OF_CLUSTER_CHAIN) ? EXFAT_OK : status;
+}
 
-        // Check if the name matches.
-        while (secondary_count--) {
-            NameEntry* entry = get_window_pointer(file);
+//--------------------------------------------------------------------------------------------------
 
-            if (entry->type != ENTRY_TYPE_NAME) {
-                return EXFAT_NAME_ENTRY_DOES_NOT_EXIST;
-            }
+// Scans the current directory for the name and records the result in the dentry cache. If the
+// window is already on an entry set, that one is checked before the directory is scanned. The
+// window is left on the stream entry.
+static int lookup_file_in_current_directory(File* file, u32 directory_cluster, SearchName* search, Dentry* result, bool use_hint) {
+    bool match = false;
+    int status;
 
-            int length = limit(name_length, NAME_ENTRY_CHARACTERS);
+    if (use_hint) {
+        status = check_entry_set_hint(file, search, &match);
+        if (status) return status;
+    }
 
-            if (compare_unicode_filename(name_pointer, entry->name, length) == false) {
-                match = false;
-                break;
-            }
+    if (match == false) {
+        status = find_file_in_current_directory(file, search);
+        if (status) return status;
+    }
 
-            status = skip_directory_entries(file, 1);
-            if (status) {
-                return status;
-            }
+    DirectoryEntry* dir_entry = get_window_pointer(file);
 
-            name_length -= length;
-            name_pointer += length;
-        }
+    result->entry_address = file->window_address;
+    result->entry_index = file->window_index;
+    result->attributes = dir_entry->attributes;
 
-        if (match) {
-            return restore_window_location(file, &saved_location);
-        }
+    status = skip_directory_entries(file, 1);
+    if (status) return status;
 
-        skip_directory_entries(file, secondary_count);
-    }
+    StreamEntry* stream = get_window_pointer(file);
+
+    result->flags = stream->flags;
+    result->first_cluster = stream->first_cluster;
+    result->length = stream->length;
+    result->valid_length = stream->valid_length;
+
+    dentry_insert(&file->exfat->dentries, directory_cluster, search->name, search->length, search->hash, result);
+    return EXFAT_OK;
 }
 
 //--------------------------------------------------------------------------------------------------
 
-static int follow_path(File* file, String* path, bool only_directory) {
+// Resolves a path relative to the directory the file currently points to. If use_hint is set, the
+// window points to an entry set which is checked before the first directory is scanned.
+static int follow_relative_path(File* file, String* path, bool only_directory, bool use_hint) {
     int status;
-
-    // @Hmm: do we need to copy the path?
-    String path_copy = *path;
     String subpath;
 
-    status = find_volume_and_rewind_to_root_directory(file, &path_copy);
-    if (status) return status;
+    u32 directory_cluster = file->file_cluster;
 
     while (1) {
-        if (get_next_valid_subpath(&path_copy, &subpath) == false) {
+        if (get_next_valid_subpath(path, &subpath) == false) {
             return EXFAT_OK;
         }
 
-        status = find_file_in_current_directory(file, &subpath);
-        if (status) return status;
+        SearchName search;
+        if (build_search_name(file->exfat, &subpath, &search) == false) {
+            return EXFAT_END_OF_FILE;
+        }
 
-        DirectoryEntry* dir_entry = get_window_pointer(file);
+        // Path components which were resolved recently do not need a directory scan.
+        Dentry result;
+        Dentry* dentry = &result;
 
-        if (only_directory && (dir_entry->attributes & FILE_ATTRIBUTES_DIRECTORY) == 0) {
-            return EXFAT_ATTRIBUTE_ERROR;
+        if (dentry_lookup(&file->exfat->dentries, directory_cluster, search.name, search.length, search.hash, &result)) {
+            add_counter(&file->exfat->counters.dentry_hits, 1);
+        }
+        else {
+            status = lookup_file_in_current_directory(file, directory_cluster, &search, &result, use_hint);
+            if (status) return status;
         }
 
-        status = skip_directory_entries(file, 1);
-        if (status) return status;
+        add_counter(&file->exfat->counters.path_lookups, 1);
+
+        use_hint = false;
 
-        StreamEntry* stream = get_window_pointer(file);
+        // Only the last path component can be a file.
+        bool is_last = path->length == 0;
+
+        if ((only_directory || is_last == false) && (dentry->attributes & FILE_ATTRIBUTES_DIRECTORY) == 0) {
+            return EXFAT_ATTRIBUTE_ERROR;
+        }
+
+        file->entry_address = dentry->entry_address;
+        file->entry_index = dentry->entry_index;
+        file->name_hash = search.hash;
+        file->parent_cluster = file->file_cluster;
+        file->parent_length = file->file_length;
+        file->parent_no_fat_chain = file->no_fat_chain;
 
         // This make it easy to go back to the beginning of a file, and implement relative paths.
         file->parent_file_address = file->file_address;
-        file->file_address = cluster_to_address(file->exfat, stream->first_cluster);
+        set_file_stream(file, dentry->first_cluster, dentry->length, dentry->valid_length, dentry->flags);
+        file->attributes = dentry->attributes;
 
-        file->file_offset = 0;
-        file->file_length = stream->length;
-        file->valid_length = stream->valid_length;
-        file->file_cluster = stream->first_cluster;
+        directory_cluster = dentry->first_cluster;
+    }
+}
 
-        file->window_index = 0;
-        status = set_window_address(file, cluster_to_address(file->exfat, stream->first_cluster));
-        if (status) return status;
+//--------------------------------------------------------------------------------------------------
+
+static int follow_path(File* file, String* path, bool only_directory) {
+    // @Hmm: do we need to copy the path?
+    String path_copy = *path;
+
+    int status = find_volume_and_rewind_to_root_directory(file, &path_copy, false);
+    if (status) return status;
+
+    return leave_volume(file, follow_relative_path(file, &path_copy, only_directory, false));
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// The directory handle is left untouched unless it is also the output handle. The entry set last
+// returned by exfat_read_directory on the directory is checked first, so opening every entry while
+// iterating over a directory does not rescan it.
+static int follow_path_at(File* directory, File* file, String* path, bool only_directory) {
+    if ((directory->attributes & FILE_ATTRIBUTES_DIRECTORY) == 0) {
+        return EXFAT_ATTRIBUTE_ERROR;
+    }
+
+    bool use_hint = directory->last_entry_valid;
+    u64 hint_address = directory->last_entry_address;
+    int hint_index = directory->last_entry_index;
+
+    enter_volume(directory->exfat, false);
+
+    if (file != directory) {
+        *file = *directory;
+        file->map_copy = 0;
+        file->extra_extents = 0;
+        file->extra_capacity = 0;
+    }
+
+    set_file_stream(file, file->file_cluster, file->file_length, file->valid_length, file->no_fat_chain ? STREAM_FLAG_NO_FAT_CHAIN : 0);
+
+    if (use_hint) {
+        file->window_index = hint_index;
+
+        int status = set_window_address(file, hint_address);
+        if (status) return leave_volume(file, status);
     }
+
+    String path_copy = *path;
+    return leave_volume(file, follow_relative_path(file, &path_copy, only_directory, use_hint));
 }
 
 //--------------------------------------------------------------------------------------------------
@@ -749,191 +1514,405 @@ static void convert_to_timestamp(Timestamp* timestamp, u32 time, u32 time_10ms,
 
 //--------------------------------------------------------------------------------------------------
 
-void exfat_init() {
-    exfat_array_init(&exfats, 8);
+static inline Extent* get_extent(File* file, int index) {
+    if (index < FILE_EXTENT_COUNT) {
+        return &file->extents[index];
+    }
+
+    return &file->extra_extents[index - FILE_EXTENT_COUNT];
 }
 
 //--------------------------------------------------------------------------------------------------
 
-int exfat_mount(DiskOps* ops, u32 address, char* mountpoint) {
-    u8 data[BLOCK_SIZE];
-
-    if (ops->read(address, data) == false) {
-        return EXFAT_DISK_ERROR;
-    }
-
-    ExFatHeader* header = (ExFatHeader *)data;
-    int status = verify_exfat_header(header);
-    if (status) return status;
-
-    ExFat* exfat = malloc(sizeof(ExFat));
+// Adds an extent to the end of the map. The memory past the runs kept in the handle grows as
+// needed. Returns zero if it can not grow, and the run is then left out of the map.
+static Extent* add_extent(File* file) {
+    if (file->extent_count - FILE_EXTENT_COUNT >= file->extra_capacity) {
+        int capacity = file->extra_capacity ? 2 * file->extra_capacity : FILE_EXTENT_COUNT;
+        Extent* extents = realloc(file->extra_extents, capacity * sizeof(Extent));
 
-    // Save the mountpoint.
-    int i;
-    for (i = 0; mountpoint[i] && i < MOUNTPOINT_NAME_SIZE - 1; i++) {
-        exfat->mountpoint_buffer[i] = mountpoint[i];
-    }
+        if (extents == 0) {
+            return 0;
+        }
 
-    if (mountpoint[i]) {
-        return EXFAT_MOUNTPOINT_ERROR;
+        file->extra_extents = extents;
+        file->extra_capacity = capacity;
     }
 
-    exfat->mountpoint_buffer[i] = 0;
-    exfat->mountpoint = convert_to_string(exfat->mountpoint_buffer);
+    return get_extent(file, file->extent_count++);
+}
 
-    // Save info about the file system.
-    exfat->ops                    = *ops;
-    exfat->volume_address_on_disk = address;
-    exfat->info                   = header->info;
-    exfat->cluster_heap_address   = exfat->volume_address_on_disk + exfat->info.cluster_heap_offset;
-    exfat->fat_table_address      = exfat->volume_address_on_disk + exfat->info.fat_offset + ((exfat->info.volume_flags & VOLUME_FLAG_ACTIVE_FAT) ? exfat->info.fat_length : 0);
-    exfat->cluster_offset_mask    = (1 << exfat->info.sectors_per_cluster_shift) - 1;
-    exfat->cluster_size           = BLOCK_SIZE << exfat->info.sectors_per_cluster_shift;
+//--------------------------------------------------------------------------------------------------
 
-    exfat_array_append(&exfats, exfat);
-    return EXFAT_OK;
+// Frees the extents which are not kept in the handle. Used by handles which the library opens for
+// itself.
+static void release_extents(File* file) {
+    free(file->extra_extents);
+    file->extra_extents = 0;
+    file->extra_capacity = 0;
+    file->extent_count = limit(file->extent_count, FILE_EXTENT_COUNT);
 }
 
 //--------------------------------------------------------------------------------------------------
 
-// The volume label must be at least 12 bytes.
-int exfat_get_volume_label(File* file, char* mountpoint, char* volume_label) {
-    String path = convert_to_string(mountpoint);
-    find_volume_and_rewind_to_root_directory(file, &path);
+// Walks the cluster chain from the end of the extent map until the cluster with the given index in
+// the file is reached. The extents are built along the way, so every part of the chain is walked at
+// most once. If the extent map can not grow, the walk continues from the cursor instead.
+static int walk_cluster_chain(File* file, u32 index, u32* cluster, u32* run_length) {
+    if (file->extent_count == 0) {
+        file->extents[0].file_cluster = 0;
+        file->extents[0].disk_cluster = file->file_cluster;
+        file->extents[0].length = 1;
+        file->extent_count = 1;
+    }
 
-    int status = move_window_to_primary_entry(ENTRY_TYPE_VOLUME_LABEL, file);
-    if (status < 0) return status;
+    Extent* last = get_extent(file, file->extent_count - 1);
 
-    VolumeLabelEntry* entry = get_window_pointer(file);
-    int length = limit(entry->label_length, sizeof(entry->label) / sizeof(Unicode));
+    u32 current_index = last->file_cluster + last->length - 1;
+    u32 current_cluster = last->disk_cluster + last->length - 1;
 
-    int i;
-    for (i = 0; i < length; i++) {
-        volume_label[i] = (char)entry->label[i];
+    if (file->cursor_index > current_index && file->cursor_index <= index) {
+        current_index = file->cursor_index;
+        current_cluster = file->cursor_cluster;
     }
 
-    volume_label[i] = 0;
-    return EXFAT_OK;
-}
+    while (current_index < index) {
+        u32 next_cluster;
+        int status = get_next_cluster(file->exfat, current_cluster, &next_cluster);
+        if (status) return status;
 
-//--------------------------------------------------------------------------------------------------
+        current_index++;
 
-int exfat_set_volume_label(File* file, char* mountpoint, char* volume_label) {
-    String path = convert_to_string(mountpoint);
-    find_volume_and_rewind_to_root_directory(file, &path);
+        // Only clusters directly following the mapped part of the file can be recorded.
+        if (current_index == last->file_cluster + last->length) {
+            if (next_cluster == last->disk_cluster + last->length) {
+                last->length++;
+            }
+            else {
+                Extent* extent = add_extent(file);
+
+                if (extent) {
+                    last = extent;
+                    last->file_cluster = current_index;
+                    last->disk_cluster = next_cluster;
+                    last->length = 1;
+                }
+            }
+        }
 
-    int status = move_window_to_primary_entry(ENTRY_TYPE_VOLUME_LABEL, file);
-    if (status < 0) return status;
+        current_cluster = next_cluster;
+    }
 
-    VolumeLabelEntry* entry = get_window_pointer(file);
+    file->cursor_index = current_index;
+    file->cursor_cluster = current_cluster;
 
-    entry->label_length = convert_to_unicode(volume_label, entry->label, sizeof(entry->label) / sizeof(Unicode));
-    file->window_dirty = true;
+    *cluster = current_cluster;
+    *run_length = 1;
 
-    sync_window(file);
+    if (index >= last->file_cluster && index < last->file_cluster + last->length) {
+        *run_length = last->file_cluster + last->length - index;
+    }
 
     return EXFAT_OK;
 }
 
 //--------------------------------------------------------------------------------------------------
 
-int exfat_open_directory(File* file, char* path) {
-    String input_path = convert_to_string(path);
-    return follow_path(file, &input_path, true);
-}
+// Translates a cluster index in the file to a cluster on the disk. The run length is the number of
+// physically contiguous clusters known to start at the returned cluster.
+static int map_file_cluster(File* file, u32 index, u32* cluster, u32* run_length) {
+    // Clusters past the end of the heap would address sectors outside the volume.
+    u64 heap_end = (u64)file->exfat->info.cluster_count + 2;
 
-//--------------------------------------------------------------------------------------------------
+    if (file->file_cluster < 2 || file->file_cluster >= heap_end) {
+        return EXFAT_BAD_CLUSTER;
+    }
 
-int exfat_read_directory(File* file, FileInfo* info) {
-    int status = move_window_to_primary_entry(ENTRY_TYPE_DIRECTORY, file);
-    if (status) return status;
+    // A contiguous file is a single run, and needs no extent map.
+    if (file->no_fat_chain) {
+        u32 cluster_count = get_file_cluster_count(file);
 
-    DirectoryEntry* dir_entry = get_window_pointer(file);
+        if (index >= cluster_count) {
+            return EXFAT_END_OF_CLUSTER_CHAIN;
+        }
 
-    info->attributes = dir_entry->attributes;
-    convert_to_timestamp(&info->create_time, dir_entry->create_time, dir_entry->create_time_10ms, dir_entry->create_utc_offset);
-    convert_to_timestamp(&info->access_time, dir_entry->access_time, 0, dir_entry->accessed_utc_offset);
-    convert_to_timestamp(&info->modified_time, dir_entry->modified_time, dir_entry->modified_time_10ms, dir_entry->modified_utc_offset);
+        if (file->file_cluster + (u64)cluster_count > heap_end) {
+            return EXFAT_BAD_CLUSTER;
+        }
 
-    int secondary_count = dir_entry->secondary_count;
+        *cluster = file->file_cluster + index;
+        *run_length = cluster_count - index;
+        return EXFAT_OK;
+    }
 
-    skip_directory_entries(file, 1);
+    int low = 0;
+    int high = file->extent_count - 1;
 
-    StreamEntry* stream_entry = get_window_pointer(file);
+    // Binary search for the last extent starting at or before the index.
+    while (low <= high) {
+        int middle = (low + high) / 2;
 
-    if (stream_entry->type != ENTRY_TYPE_STREAM) {
-        return EXFAT_DIRECTORY_ENTRY_ERROR;
+        if (get_extent(file, middle)->file_cluster <= index) {
+            low = middle + 1;
+        }
+        else {
+            high = middle - 1;
+        }
     }
 
-    info->length = stream_entry->length;
+    if (high >= 0) {
+        Extent* extent = get_extent(file, high);
 
-    int name_length = stream_entry->name_length;
+        if (index < extent->file_cluster + extent->length) {
+            *cluster = extent->disk_cluster + (index - extent->file_cluster);
+            *run_length = extent->file_cluster + extent->length - index;
+            return EXFAT_OK;
+        }
+    }
 
-    // Skip the stream entry.
-    skip_directory_entries(file, 1);
-    secondary_count--;
+    return walk_cluster_chain(file, index, cluster, run_length);
+}
 
-    char* name_buffer = info->filename;
+//--------------------------------------------------------------------------------------------------
 
-    while (secondary_count) {
-        if (name_length == 0) {
-            return EXFAT_DIRECTORY_ENTRY_ERROR;
-        }
+// Computes the sector holding the current file offset.
+static int get_file_offset_address(File* file, u64* address) {
+    ExFat* exfat = file->exfat;
 
-        NameEntry* name_entry = get_window_pointer(file);
+    u32 cluster;
+    u32 run_length;
 
-        if (name_entry->type != ENTRY_TYPE_NAME) {
-            return EXFAT_DIRECTORY_ENTRY_ERROR;
-        }
+    int status = map_file_cluster(file, file->file_offset / exfat->cluster_size, &cluster, &run_length);
+    if (status) return status;
 
-        int size = limit(name_length, NAME_ENTRY_CHARACTERS);
+    u32 cluster_offset = file->file_offset & (exfat->cluster_size - 1);
 
-        for (int i = 0; i < size; i++) {
-            name_buffer[i] = (char)name_entry->name[i];
-        }
+    *address = cluster_to_address(exfat, cluster) + (cluster_offset >> exfat->info.bytes_per_sector_shift);
+    return EXFAT_OK;
+}
 
-        name_length -= size;
-        name_buffer += size;
+//--------------------------------------------------------------------------------------------------
 
-        skip_directory_entries(file, 1);
-        secondary_count--;
+// Finds the sectors backing up to block_count whole sectors from the current file offset. The run
+// is grown over physically contiguous clusters so that it can be issued as a single disk request.
+static int get_sector_run(File* file, u32 block_count, u64* address, u32* run_count) {
+    ExFat* exfat = file->exfat;
+
+    u32 index = file->file_offset / exfat->cluster_size;
+    u32 cluster_blocks = 1 << exfat->info.sectors_per_cluster_shift;
+    u32 first_block = (file->file_offset & (exfat->cluster_size - 1)) >> exfat->info.bytes_per_sector_shift;
+
+    u32 cluster;
+    u32 run_length;
+
+    int status = map_file_cluster(file, index, &cluster, &run_length);
+    if (status) return status;
+
+    u32 count = limit((u64)block_count, (u64)run_length * cluster_blocks - first_block);
+
+    while (count < block_count) {
+        u32 next_cluster;
+        u32 next_length;
+
+        status = map_file_cluster(file, index + run_length, &next_cluster, &next_length);
+        if (status) return status;
+
+        if (next_cluster != cluster + run_length) {
+            break;
+        }
+
+        run_length += next_length;
+        count = limit((u64)block_count, (u64)run_length * cluster_blocks - first_block);
     }
 
-    name_buffer[0] = 0;
+    *address = cluster_to_address(exfat, cluster) + first_block;
+    *run_count = count;
+    return EXFAT_OK;
+}
 
-    if (secondary_count) {
-        skip_directory_entries(file, secondary_count);
-        return EXFAT_DIRECTORY_ENTRY_ERROR;
+//--------------------------------------------------------------------------------------------------
+
+// Sectors at the start of the run which are already cached, usually by readahead, are copied from
+// the cache. The rest of the run is read directly. The whole run is used, so that resolving it
+// again never has to go back behind the cluster chain cursor.
+static int read_sector_run(File* file, u8* data, u32 block_count, int* size) {
+    ExFat* exfat = file->exfat;
+    u64 address;
+    u32 count;
+
+    int status = get_sector_run(file, block_count, &address, &count);
+    if (status) return status;
+
+    u32 cached = 0;
+
+    while (cached < count) {
+        CacheBlock* block = cache_find(&exfat->cache, address + cached);
+
+        if (block == 0) {
+            break;
+        }
+
+        memory_copy(block->data, data + cached * exfat->block_size, exfat->block_size);
+        cache_unpin(&exfat->cache, block);
+        cached++;
     }
 
+    if (cached < count) {
+        status = read_blocks(exfat, address + cached, count - cached, data + cached * exfat->block_size);
+        if (status) return status;
+    }
+
+    *size = count * exfat->block_size;
     return EXFAT_OK;
 }
 
 //--------------------------------------------------------------------------------------------------
 
-int exfat_open_file(File* file, char* path) {
-    String input_path = convert_to_string(path);
-    return follow_path(file, &input_path, false);
+static int write_sector_run(File* file, const u8* data, u32 block_count, int* size) {
+    u64 address;
+    u32 count;
+
+    int status = get_sector_run(file, block_count, &address, &count);
+    if (status) return status;
+
+    status = write_blocks(file->exfat, address, count, data);
+    if (status) return status;
+
+    *size = count * file->exfat->block_size;
+    return EXFAT_OK;
 }
 
 //--------------------------------------------------------------------------------------------------
 
-int exfat_file_read(File* file, void* data, int size, int* bytes_written) {
+// Largest useful window for the volume. Prefetching more than the cache takes at a time would only
+// evict data before it is read.
+static u32 limit_readahead(ExFat* exfat, u32 size) {
+    return limit(size, exfat->cache.prefetch_blocks * exfat->block_size);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Loads the sectors backing a range of the file into the cache. The range might span several
+// cluster runs, and each one becomes a separate request. The chain cursor is put back afterwards,
+// since the reads following the prefetch continue the walk from behind the prefetched range.
+static int prefetch_file_range(File* file, u64 start, u64 end) {
+    u64 saved_offset = file->file_offset;
+    u32 saved_cursor_index = file->cursor_index;
+    u32 saved_cursor_cluster = file->cursor_cluster;
+    u32 block_size = file->exfat->block_size;
+    int status = EXFAT_OK;
+
+    file->file_offset = start & ~(u64)(block_size - 1);
+
+    while (file->file_offset < end) {
+        u64 address;
+        u32 count;
+
+        status = get_sector_run(file, (end - file->file_offset + block_size - 1) / block_size, &address, &count);
+        if (status) break;
+
+        if (cache_prefetch(&file->exfat->cache, address, count) == false) {
+            status = EXFAT_DISK_ERROR;
+            break;
+        }
+
+        file->file_offset += (u64)count * block_size;
+    }
+
+    file->file_offset = saved_offset;
+    file->cursor_index = saved_cursor_index;
+    file->cursor_cluster = saved_cursor_cluster;
+    return status;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Detects sequential reads and prefetches the sectors ahead of them into the cache, so that a
+// stream of small reads does not turn into a stream of small disk requests. Reads larger than the
+// window are already issued as multi-sector requests and are left alone.
+static int read_ahead(File* file, int size) {
+    ExFat* exfat = file->exfat;
+
+    bool sequential = file->file_offset == file->readahead_next;
+    file->readahead_next = file->file_offset + size;
+
+    if (sequential == false || exfat->readahead_max < MIN_READAHEAD_SIZE) {
+        file->readahead_size = 0;
+        file->readahead_end = 0;
+        return EXFAT_OK;
+    }
+
+    u64 end = file->file_offset + size;
+
+    if (end <= file->readahead_end) {
+        return EXFAT_OK;
+    }
+
+    if (file->readahead_size == 0) {
+        file->readahead_size = MIN_READAHEAD_SIZE;
+    }
+    else {
+        file->readahead_size = limit(2 * file->readahead_size, exfat->readahead_max);
+    }
+
+    if (size >= file->readahead_size) {
+        return EXFAT_OK;
+    }
+
+    u64 start = (file->readahead_end > file->file_offset) ? file->readahead_end : file->file_offset;
+    end = limit(start + file->readahead_size, file->valid_length);
+
+    file->readahead_end = end;
+    return prefetch_file_range(file, start, end);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static int read_file(File* file, void* data, int size, int* bytes_written) {
+    if (size < 0) {
+        return EXFAT_FILE_OFFSET_OUT_OF_RANGE;
+    }
+
     int written = 0;
     int total_size = limit(size, file->file_length - file->file_offset);
+    int block_size = file->exfat->block_size;
     u8* pointer = data;
 
+    int status = read_ahead(file, total_size);
+    if (status) return status;
+
     while (total_size) {
-        size = limit(total_size, BLOCK_SIZE - file->window_index);
+        int block_offset = file->file_offset & (block_size - 1);
 
-        int status = cache_window(file);
-        if (status) return status;
+        // Nothing has been written past the valid length, so that part reads as zeros without going
+        // to the disk.
+        int valid_size = 0;
+
+        if (file->file_offset < file->valid_length) {
+            valid_size = limit(total_size, file->valid_length - file->file_offset);
+        }
 
-        memory_copy(get_window_pointer(file), pointer, size);
+        if (valid_size == 0) {
+            size = total_size;
+            memory_clear(pointer, size);
+        }
+        else if (block_offset == 0 && valid_size >= block_size) {
+            // Whole sectors bypass the window and go straight into the caller's buffer.
+            status = read_sector_run(file, pointer, valid_size / block_size, &size);
+            if (status) return status;
+        }
+        else {
+            size = limit(valid_size, block_size - block_offset);
 
-        status = increment_directory_offset(file, size);
-        if (status) {
-            return status;
+            u64 address;
+            status = get_file_offset_address(file, &address);
+            if (status) return status;
+
+            file->window_index = block_offset;
+            status = set_window_address(file, address);
+            if (status) return status;
+
+            memory_copy(get_window_pointer(file), pointer, size);
         }
 
         total_size -= size;
@@ -942,26 +1921,2255 @@ int exfat_file_read(File* file, void* data, int size, int* bytes_written) {
         file->file_offset += size;
     }
 
+    add_counter(&file->exfat->counters.bytes_read, written);
+
     *bytes_written = written;
     return EXFAT_OK;
 }
 
 //--------------------------------------------------------------------------------------------------
 
-int exfat_set_file_offset(File* file, u64 offset) {
-    if (offset >= file->file_length) {
+static int set_file_offset(File* file, u64 offset) {
+    if (offset > file->file_length) {
         return EXFAT_FILE_OFFSET_OUT_OF_RANGE;
     }
 
-    // Rewind.
-    file->window_address = cluster_to_address(file->exfat, file->file_cluster);
-    file->window_index = 0;
+    file->file_offset = offset;
+
+    // The end of the file is a valid offset for appending, but has no sector until the file grows.
+    if (offset == file->file_length) {
+        release_window(file);
+        return EXFAT_OK;
+    }
+
+    // Resolve the cluster now so that errors in the cluster chain are reported by the seek. The
+    // sector itself is not read until it is needed.
+    u64 address;
+    int status = get_file_offset_address(file, &address);
+    if (status) return status;
+
+    move_window_lazy(file, address);
+    file->window_index = offset & (file->exfat->block_size - 1);
 
-    return increment_directory_offset(file, offset);
+    return EXFAT_OK;
 }
 
 //--------------------------------------------------------------------------------------------------
 
-int exfat_flush(File* file) {
-    return sync_window(file);
+// Volumes without an up-case table still get case insensitive lookups for ASCII names.
+static bool set_default_upcase_table(ExFat* exfat) {
+    exfat->upcase_count = 128;
+    exfat->upcase_table = malloc(exfat->upcase_count * sizeof(Unicode));
+
+    if (exfat->upcase_table == 0) {
+        return false;
+    }
+
+    for (u32 i = 0; i < exfat->upcase_count; i++) {
+        exfat->upcase_table[i] = (i >= 'a' && i <= 'z') ? i - 'a' + 'A' : i;
+    }
+
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Expands a possibly compressed up-case table. In the compressed form, the value 0xFFFF is followed
+// by the number of characters which map to themselves.
+static int expand_upcase_table(ExFat* exfat, Unicode* raw, int raw_count) {
+    Unicode* table = malloc(UPCASE_TABLE_SIZE * sizeof(Unicode));
+
+    if (table == 0) {
+        return EXFAT_OUT_OF_MEMORY;
+    }
+
+    u32 count = 0;
+
+    for (int i = 0; i < raw_count && count < UPCASE_TABLE_SIZE; i++) {
+        if (raw[i] == UPCASE_TABLE_COMPRESSION && i + 1 < raw_count) {
+            u32 run = raw[++i];
+
+            for (u32 j = 0; j < run && count < UPCASE_TABLE_SIZE; j++, count++) {
+                table[count] = count;
+            }
+        }
+        else {
+            table[count++] = raw[i];
+        }
+    }
+
+    // Only keep the table up to the last character which is not mapped to itself.
+    while (count && table[count - 1] == count - 1) {
+        count--;
+    }
+
+    exfat->upcase_table = table;
+    exfat->upcase_count = count;
+    return EXFAT_OK;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static bool is_ascii_upcase(ExFat* exfat) {
+    for (Unicode c = 0; c < 0x80; c++) {
+        Unicode expected = (c >= 'a' && c <= 'z') ? c - 'a' + 'A' : c;
+
+        if (upcase(exfat, c) != expected) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static int load_upcase_table(ExFat* exfat) {
+    File file = {0};
+    file.exfat = exfat;
+
+    int status = go_to_root_directory(&file);
+    if (status) return status;
+
+    status = move_window_to_primary_entry(ENTRY_TYPE_UPCASE_TABLE, &file);
+    if (status < 0) return status;
+
+    UpcaseTableEntry* entry = get_window_pointer(&file);
+
+    if (status == EXFAT_END_OF_FILE || entry->length < sizeof(Unicode)) {
+        release_window(&file);
+        return set_default_upcase_table(exfat) ? EXFAT_OK : EXFAT_OUT_OF_MEMORY;
+    }
+
+    int size = limit(entry->length, UPCASE_TABLE_SIZE * sizeof(Unicode));
+
+    set_file_stream(&file, entry->first_cluster, size, size, 0);
+
+    Unicode* raw = malloc(size);
+    if (raw == 0) {
+        release_window(&file);
+        return EXFAT_OUT_OF_MEMORY;
+    }
+
+    int read;
+    status = read_file(&file, raw, size, &read);
+
+    if (status == EXFAT_OK) {
+        status = expand_upcase_table(exfat, raw, read / sizeof(Unicode));
+    }
+
+    release_window(&file);
+    release_extents(&file);
+    free(raw);
+    return status;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Volumes using both FATs (TexFAT) have two bitmaps. The active FAT flag selects which one is used.
+static int load_allocation_bitmap(ExFat* exfat) {
+    File* file = &exfat->bitmap;
+    file->exfat = exfat;
+    file->window_valid = false;
+    file->no_fat_chain = false;
+    file->extra_extents = 0;
+    file->extra_capacity = 0;
+
+    int status = go_to_root_directory(file);
+    if (status) return status;
+
+    int skip = (exfat->info.fat_count == 2 && (exfat->info.volume_flags & VOLUME_FLAG_ACTIVE_FAT)) ? 1 : 0;
+
+    while (1) {
+        status = move_window_to_primary_entry(ENTRY_TYPE_ALLOC_BITMAP, file);
+        if (status > 0) return EXFAT_DIRECTORY_ENTRY_ERROR;
+        if (status) return status;
+
+        if (skip-- == 0) {
+            break;
+        }
+
+        status = skip_directory_entries(file, 1);
+        if (status) return status;
+    }
+
+    BitmapEntry* entry = get_window_pointer(file);
+    u64 length = (exfat->info.cluster_count + 7) / 8;
+
+    if (entry->length < length) {
+        return EXFAT_DIRECTORY_ENTRY_ERROR;
+    }
+
+    set_file_stream(file, entry->first_cluster, length, length, 0);
+
+    exfat->bitmap_chunk_count = (length + BITMAP_CHUNK_SIZE - 1) / BITMAP_CHUNK_SIZE;
+    exfat->bitmap_chunks = malloc(exfat->bitmap_chunk_count * sizeof(BitmapSummary));
+    exfat->bitmap_chunk_dirty = malloc(exfat->bitmap_chunk_count * sizeof(bool));
+
+    if (exfat->bitmap_chunks == 0 || exfat->bitmap_chunk_dirty == 0) {
+        return EXFAT_OUT_OF_MEMORY;
+    }
+
+    // The bitmap is scanned the first time free space is requested.
+    for (int i = 0; i < exfat->bitmap_chunk_count; i++) {
+        exfat->bitmap_chunk_dirty[i] = true;
+    }
+
+    exfat->space_valid = false;
+    exfat->free_valid = false;
+    return EXFAT_OK;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Rescans the bitmap chunks which have changed, and merges the chunk summaries.
+static int update_space_info(ExFat* exfat) {
+    if (exfat->space_valid) {
+        return EXFAT_OK;
+    }
+
+    int status;
+    u8* buffer = malloc(BITMAP_CHUNK_SIZE);
+    if (buffer == 0) {
+        return EXFAT_OUT_OF_MEMORY;
+    }
+
+    u32 chunk_bits = BITMAP_CHUNK_SIZE * 8;
+
+    for (int i = 0; i < exfat->bitmap_chunk_count; i++) {
+        if (exfat->bitmap_chunk_dirty[i] == false) {
+            continue;
+        }
+
+        int read;
+        status = set_file_offset(&exfat->bitmap, (u64)i * BITMAP_CHUNK_SIZE);
+
+        if (status == EXFAT_OK) {
+            status = read_file(&exfat->bitmap, buffer, BITMAP_CHUNK_SIZE, &read);
+        }
+
+        if (status) {
+            release_window(&exfat->bitmap);
+            free(buffer);
+            return status;
+        }
+
+        u32 bits = limit(exfat->info.cluster_count - i * chunk_bits, chunk_bits);
+
+        bitmap_summarize(buffer, bits, &exfat->bitmap_chunks[i]);
+        exfat->bitmap_chunk_dirty[i] = false;
+    }
+
+    release_window(&exfat->bitmap);
+    free(buffer);
+
+    bitmap_combine(exfat->bitmap_chunks, exfat->bitmap_chunk_count, &exfat->free_clusters, &exfat->largest_free_run);
+    exfat->space_valid = true;
+    exfat->free_valid = true;
+
+    return EXFAT_OK;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Returns the cache block holding the allocation bit of the cluster, and the index of the bit in
+// it. The block is pinned until the caller unpins it.
+static int get_bitmap_block(ExFat* exfat, u32 cluster, CacheBlock** block, u32* bit) {
+    u32 index = cluster - 2;
+    u64 address;
+
+    exfat->bitmap.file_offset = (index / 8) & ~(exfat->block_size - 1);
+
+    int status = get_file_offset_address(&exfat->bitmap, &address);
+    if (status) return status;
+
+    *block = cache_get(&exfat->cache, address);
+
+    if (*block == 0) {
+        return EXFAT_DISK_ERROR;
+    }
+
+    *bit = index & (exfat->block_size * 8 - 1);
+    return EXFAT_OK;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Marks a run of clusters as used or free. The free cluster count is updated right away, while the
+// changed chunks are rescanned the next time the largest free run is requested.
+static int set_bitmap_run(ExFat* exfat, u32 cluster, u32 count, bool used) {
+    while (count) {
+        CacheBlock* block;
+        u32 bit;
+
+        int status = get_bitmap_block(exfat, cluster, &block, &bit);
+        if (status) return status;
+
+        u32 length = limit(count, exfat->block_size * 8 - bit);
+
+        for (u32 i = bit; i < bit + length; i++) {
+            u8 mask = 1 << (i % 8);
+
+            if (((block->data[i / 8] & mask) != 0) == used) {
+                continue;
+            }
+
+            block->data[i / 8] ^= mask;
+            exfat->free_clusters += used ? -1 : 1;
+        }
+
+        cache_mark_dirty(&exfat->cache, block);
+        cache_unpin(&exfat->cache, block);
+        exfat->bitmap_chunk_dirty[(cluster - 2) / (BITMAP_CHUNK_SIZE * 8)] = true;
+
+        cluster += length;
+        count -= length;
+    }
+
+    exfat->space_valid = false;
+    return EXFAT_OK;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Counts the free clusters directly following the given cluster, up to count.
+static int get_free_run_at(ExFat* exfat, u32 cluster, u32 count, u32* length) {
+    *length = 0;
+
+    while (*length < count) {
+        CacheBlock* block;
+        u32 bit;
+
+        int status = get_bitmap_block(exfat, cluster, &block, &bit);
+        if (status) return status;
+
+        bool used = false;
+
+        for (; bit < exfat->block_size * 8 && *length < count; bit++, cluster++) {
+            if (block->data[bit / 8] & (1 << (bit % 8))) {
+                used = true;
+                break;
+            }
+
+            (*length)++;
+        }
+
+        cache_unpin(&exfat->cache, block);
+
+        if (used) {
+            return EXFAT_OK;
+        }
+    }
+
+    return EXFAT_OK;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Searches the clusters in [from, to) for the first free run of at least count clusters. If there
+// is no such run, the largest run found is returned instead. Chunks known to be full are skipped.
+static int find_free_run(ExFat* exfat, u32 from, u32 to, u32 count, u32* run_cluster, u32* run_length) {
+    u32 chunk_bits = BITMAP_CHUNK_SIZE * 8;
+    u32 cluster = from;
+    u32 run_start = 0;
+    u32 run = 0;
+
+    *run_length = 0;
+
+    while (cluster < to) {
+        u32 chunk = (cluster - 2) / chunk_bits;
+
+        if (exfat->bitmap_chunk_dirty[chunk] == false && exfat->bitmap_chunks[chunk].free == 0) {
+            cluster = 2 + (chunk + 1) * chunk_bits;
+            run = 0;
+            continue;
+        }
+
+        CacheBlock* block;
+        u32 bit;
+
+        int status = get_bitmap_block(exfat, cluster, &block, &bit);
+        if (status) return status;
+
+        u32 end = bit + limit(to - cluster, exfat->block_size * 8 - bit);
+
+        for (; bit < end; bit++, cluster++) {
+            u8 byte = block->data[bit / 8];
+
+            // Fully used bytes are skipped in one step.
+            if (byte == 0xFF && (bit % 8) == 0 && end - bit >= 8) {
+                bit += 7;
+                cluster += 7;
+                run = 0;
+                continue;
+            }
+
+            if (byte & (1 << (bit % 8))) {
+                run = 0;
+                continue;
+            }
+
+            if (run++ == 0) {
+                run_start = cluster;
+            }
+
+            if (run > *run_length) {
+                *run_cluster = run_start;
+                *run_length = run;
+
+                if (run >= count) {
+                    break;
+                }
+            }
+        }
+
+        cache_unpin(&exfat->cache, block);
+
+        if (*run_length >= count) {
+            return EXFAT_OK;
+        }
+    }
+
+    return EXFAT_OK;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Finds the largest free run on the volume. The chunk summaries tell which chunk holds it, or where
+// it starts if it spans several chunks, so at most one chunk is scanned.
+static int find_largest_run(ExFat* exfat, u32* run_cluster, u32* run_length) {
+    int status = update_space_info(exfat);
+    if (status) return status;
+
+    u32 chunk_bits = BITMAP_CHUNK_SIZE * 8;
+    u32 run = 0;
+    u32 run_start = 2;
+    u32 best = 0;
+    int best_chunk = -1;
+
+    *run_cluster = 0;
+    *run_length = 0;
+
+    for (int i = 0; i < exfat->bitmap_chunk_count; i++) {
+        const BitmapSummary* summary = &exfat->bitmap_chunks[i];
+        u32 base = 2 + i * chunk_bits;
+
+        if (run == 0) {
+            run_start = base;
+        }
+
+        if (summary->leading == summary->bits) {
+            run += summary->bits;
+            continue;
+        }
+
+        run += summary->leading;
+
+        if (run > best) {
+            best = run;
+            best_chunk = -1;
+            *run_cluster = run_start;
+        }
+
+        if (summary->largest > best) {
+            best = summary->largest;
+            best_chunk = i;
+        }
+
+        run = summary->trailing;
+        run_start = base + summary->bits - summary->trailing;
+    }
+
+    if (run > best) {
+        best = run;
+        best_chunk = -1;
+        *run_cluster = run_start;
+    }
+
+    if (best_chunk < 0) {
+        *run_length = best;
+        return EXFAT_OK;
+    }
+
+    u32 base = 2 + best_chunk * chunk_bits;
+    return find_free_run(exfat, base, base + exfat->bitmap_chunks[best_chunk].bits, best, run_cluster, run_length);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Records a run appended to the end of the file, if the extent map reaches that far.
+static void append_extent(File* file, u32 index, u32 cluster, u32 length) {
+    if (file->extent_count == 0) {
+        return;
+    }
+
+    Extent* last = get_extent(file, file->extent_count - 1);
+
+    if (last->file_cluster + last->length != index) {
+        return;
+    }
+
+    if (last->disk_cluster + last->length == cluster) {
+        last->length += length;
+        return;
+    }
+
+    last = add_extent(file);
+
+    if (last) {
+        last->file_cluster = index;
+        last->disk_cluster = cluster;
+        last->length = length;
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Appends newly allocated clusters to the file. A file stays in NoFatChain mode as long as it is
+// contiguous. The first run which does not follow the file converts the whole file to a FAT chain.
+static int link_clusters(File* file, u32 index, u32 last, u32 cluster, u32 length) {
+    ExFat* exfat = file->exfat;
+    int status;
+
+    if (index == 0) {
+        file->file_cluster = cluster;
+        file->file_address = cluster_to_address(exfat, cluster);
+        file->no_fat_chain = true;
+        file->extent_count = 0;
+        file->cursor_index = 0;
+        file->cursor_cluster = cluster;
+        return EXFAT_OK;
+    }
+
+    if (file->no_fat_chain) {
+        if (cluster == last + 1) {
+            return EXFAT_OK;
+        }
+
+        for (u32 i = file->file_cluster; i < last; i++) {
+            status = set_fat_entry(exfat, i, i + 1);
+            if (status) return status;
+        }
+
+        file->no_fat_chain = false;
+        file->extents[0].file_cluster = 0;
+        file->extents[0].disk_cluster = file->file_cluster;
+        file->extents[0].length = index;
+        file->extent_count = 1;
+    }
+
+    status = set_fat_entry(exfat, last, cluster);
+    if (status) return status;
+
+    for (u32 i = cluster; i < cluster + length - 1; i++) {
+        status = set_fat_entry(exfat, i, i + 1);
+        if (status) return status;
+    }
+
+    status = set_fat_entry(exfat, cluster + length - 1, FAT_ENTRY_END_OF_CLUSTER_CHAIN_VALUE);
+    if (status) return status;
+
+    append_extent(file, index, cluster, length);
+    return EXFAT_OK;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Grows the file from cluster_count to cluster_count + count clusters. The free clusters directly
+// after the file are used first. The rest goes at the start of the largest free run, which leaves
+// the file the most room to keep growing in place. A file is only split over several runs when no
+// single run is large enough.
+static int allocate_clusters(File* file, u32 cluster_count, u32 count) {
+    ExFat* exfat = file->exfat;
+    int status;
+
+    if (exfat->free_valid == false) {
+        status = update_space_info(exfat);
+        if (status) return status;
+    }
+
+    if (exfat->free_clusters < count) {
+        return EXFAT_DISK_FULL;
+    }
+
+    u32 end = exfat->info.cluster_count + 2;
+    u32 index = cluster_count;
+    u32 last = 0;
+
+    if (index) {
+        u32 run_length;
+        status = map_file_cluster(file, index - 1, &last, &run_length);
+        if (status) return status;
+    }
+
+    while (count) {
+        u32 cluster = last + 1;
+        u32 length = 0;
+
+        if (last && cluster < end) {
+            status = get_free_run_at(exfat, cluster, limit(count, end - cluster), &length);
+            if (status) return status;
+        }
+
+        if (length == 0) {
+            status = find_largest_run(exfat, &cluster, &length);
+            if (status) return status;
+
+            length = limit(length, count);
+        }
+
+        if (length == 0) {
+            return EXFAT_DISK_FULL;
+        }
+
+        status = set_bitmap_run(exfat, cluster, length, true);
+        if (status) return status;
+
+        status = link_clusters(file, index, last, cluster, length);
+        if (status) return status;
+
+        index += length;
+        count -= length;
+        last = cluster + length - 1;
+    }
+
+    return EXFAT_OK;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Makes sure clusters are allocated for the given length, and sets the file length. The valid
+// length is left alone.
+static int grow_file(File* file, u64 length) {
+    u32 cluster_count = get_file_cluster_count(file);
+    u32 needed = (length + file->exfat->cluster_size - 1) / file->exfat->cluster_size;
+
+    if (needed > cluster_count) {
+        int status = allocate_clusters(file, cluster_count, needed - cluster_count);
+        if (status) return status;
+    }
+
+    file->file_length = length;
+    return EXFAT_OK;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Writes the stream of the file back to its entry set and recomputes the entry set checksum. The
+// cached copy in the dentry cache is updated as well.
+static int update_entry_set(File* file) {
+    ExFat* exfat = file->exfat;
+
+    File directory;
+    directory.exfat = exfat;
+    directory.window_valid = false;
+    directory.extra_extents = 0;
+    directory.extra_capacity = 0;
+    set_file_stream(&directory, file->parent_cluster, file->parent_length, file->parent_length, file->parent_no_fat_chain ? STREAM_FLAG_NO_FAT_CHAIN : 0);
+
+    directory.window_index = file->entry_index;
+    int status = set_window_address(&directory, file->entry_address);
+    if (status) return status;
+
+    SavedLocation primary;
+    save_window_location(&directory, &primary);
+
+    DirectoryEntry* dir_entry = get_window_pointer(&directory);
+    int secondary_count = dir_entry->secondary_count;
+
+    u8 flags = STREAM_FLAG_ALLOCATION_POSSIBLE | (file->no_fat_chain ? STREAM_FLAG_NO_FAT_CHAIN : 0);
+    u16 checksum = compute_entry_checksum(0, (u8 *)dir_entry, true);
+
+    for (int i = 0; i < secondary_count; i++) {
+        status = skip_directory_entries(&directory, 1);
+        if (status) break;
+
+        Entry* entry = get_window_pointer(&directory);
+
+        if (i == 0) {
+            if (entry->type != ENTRY_TYPE_STREAM) {
+                status = EXFAT_DIRECTORY_ENTRY_ERROR;
+                break;
+            }
+
+            entry->stream.flags = flags;
+            entry->stream.first_cluster = file->file_cluster;
+            entry->stream.length = file->file_length;
+            entry->stream.valid_length = file->valid_length;
+            cache_mark_dirty(&exfat->cache, directory.window);
+        }
+
+        checksum = compute_entry_checksum(checksum, (u8 *)entry, false);
+    }
+
+    if (status) {
+        release_window_location(&directory, &primary);
+        release_window(&directory);
+        return status;
+    }
+
+    status = restore_window_location(&directory, &primary);
+    if (status) return status;
+
+    dir_entry = get_window_pointer(&directory);
+    dir_entry->checksum = checksum;
+    cache_mark_dirty(&exfat->cache, directory.window);
+    release_window(&directory);
+
+    Dentry* dentry = dentry_find_entry(&exfat->dentries, file->parent_cluster, file->name_hash, file->entry_address, file->entry_index);
+
+    if (dentry) {
+        dentry->flags = flags;
+        dentry->first_cluster = file->file_cluster;
+        dentry->length = file->file_length;
+        dentry->valid_length = file->valid_length;
+    }
+
+    return EXFAT_OK;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Writes at the current file offset, which must be inside the allocated part of the file. Partial
+// sectors are changed in the cache, while whole sectors go straight to the disk.
+static int write_file_data(File* file, const u8* data, u64 size) {
+    u32 block_size = file->exfat->block_size;
+
+    while (size) {
+        int status;
+        int length;
+
+        int block_offset = file->file_offset & (block_size - 1);
+
+        if (block_offset == 0 && size >= block_size) {
+            status = write_sector_run(file, data, size / block_size, &length);
+            if (status) return status;
+        }
+        else {
+            length = limit(size, block_size - block_offset);
+
+            u64 address;
+            status = get_file_offset_address(file, &address);
+            if (status) return status;
+
+            file->window_index = block_offset;
+            status = set_window_address(file, address);
+            if (status) return status;
+
+            memory_copy(data, get_window_pointer(file), length);
+            cache_mark_dirty(&file->exfat->cache, file->window);
+        }
+
+        size -= length;
+        data += length;
+        file->file_offset += length;
+    }
+
+    return EXFAT_OK;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Clears the file between two offsets.
+static int zero_file_data(File* file, u64 from, u64 to) {
+    file->file_offset = from;
+
+    while (file->file_offset < to) {
+        int status = write_file_data(file, zero_blocks, limit(to - file->file_offset, sizeof(zero_blocks)));
+        if (status) return status;
+    }
+
+    return EXFAT_OK;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void exfat_init() {
+    exfat_array_init(&exfats, 8);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Reads the boot sector of a volume into a buffer of MAX_BLOCK_SIZE bytes and checks it.
+static int read_boot_sector(DiskOps* ops, u64 address, u8* data) {
+    u32 block_size = ops->block_size ? ops->block_size : BLOCK_SIZE;
+
+    if (block_size > MAX_BLOCK_SIZE) {
+        return EXFAT_SECTOR_SIZE_ERROR;
+    }
+
+    u64 start = trace_begin(TRACE_DISK_READ);
+    bool success = ops->read(address, data);
+    trace_end(TRACE_DISK_READ, start);
+
+    if (success == false) {
+        return EXFAT_DISK_ERROR;
+    }
+
+    return verify_exfat_header((ExFatHeader *)data, block_size);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Reads the main boot region and compares its checksum against every word of the checksum sector.
+static int verify_boot_region(DiskOps* ops, u64 address, u32 block_size) {
+    u8* data = malloc((BOOT_CHECKSUM_SECTOR + 1) * block_size);
+
+    if (data == 0) {
+        return EXFAT_OUT_OF_MEMORY;
+    }
+
+    bool success = true;
+
+    if (ops->read_blocks) {
+        u64 start = trace_begin(TRACE_DISK_READ_BLOCKS);
+        success = ops->read_blocks(address, BOOT_CHECKSUM_SECTOR + 1, data);
+        trace_end(TRACE_DISK_READ_BLOCKS, start);
+    }
+    else {
+        for (int i = 0; i <= BOOT_CHECKSUM_SECTOR && success; i++) {
+            u64 start = trace_begin(TRACE_DISK_READ);
+            success = ops->read(address + i, data + i * block_size);
+            trace_end(TRACE_DISK_READ, start);
+        }
+    }
+
+    int status = success ? EXFAT_OK : EXFAT_DISK_ERROR;
+
+    if (status == EXFAT_OK) {
+        u32 checksum = compute_boot_checksum(data, block_size);
+        u32* words = (u32 *)(data + BOOT_CHECKSUM_SECTOR * block_size);
+
+        for (u32 i = 0; i < block_size / 4; i++) {
+            if (words[i] != checksum) {
+                status = EXFAT_CHECKSUM_ERROR;
+                break;
+            }
+        }
+    }
+
+    free(data);
+    return status;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Frees a volume which failed to mount after its block cache was set up. The volume is zeroed when
+// it is allocated, so only the parts which were loaded are freed.
+static int abort_mount(ExFat* exfat, int status) {
+    free(exfat->bitmap_chunks);
+    free(exfat->bitmap_chunk_dirty);
+    release_extents(&exfat->bitmap);
+    free(exfat->upcase_table);
+
+    if (exfat->dentries.entries) {
+        dentry_cache_free(&exfat->dentries);
+    }
+
+    cache_free(&exfat->cache);
+    free(exfat);
+    return status;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// The cache size is the number of bytes the volume may use for caching sectors. It is shared by all
+// files opened on the volume. The header must have been checked by read_boot_sector.
+static int mount_volume(DiskOps* ops, u64 address, const ExFatHeader* header, char* mountpoint, int cache_size, int flags) {
+    u32 block_size = ops->block_size ? ops->block_size : BLOCK_SIZE;
+    int status;
+
+    // The mountpoint and the terminator must fit in the buffer.
+    int length = 0;
+    while (length < MOUNTPOINT_NAME_SIZE && mountpoint[length]) {
+        length++;
+    }
+
+    if (length == MOUNTPOINT_NAME_SIZE) {
+        return EXFAT_MOUNTPOINT_ERROR;
+    }
+
+    if (flags & EXFAT_MOUNT_VERIFY) {
+        status = verify_boot_region(ops, address, block_size);
+        if (status) return status;
+    }
+
+    ExFat* exfat = calloc(1, sizeof(ExFat));
+
+    if (exfat == 0) {
+        return EXFAT_OUT_OF_MEMORY;
+    }
+
+    // Save the mountpoint.
+    for (int i = 0; i <= length; i++) {
+        exfat->mountpoint_buffer[i] = mountpoint[i];
+    }
+
+    exfat->mountpoint = convert_to_string(exfat->mountpoint_buffer);
+
+    // Save info about the file system.
+    exfat->ops                    = *ops;
+    exfat->ops.block_size         = block_size;
+    exfat->volume_address_on_disk = address;
+    exfat->info                   = header->info;
+    exfat->cluster_heap_address   = exfat->volume_address_on_disk + exfat->info.cluster_heap_offset;
+    exfat->fat_table_address      = exfat->volume_address_on_disk + exfat->info.fat_offset + ((exfat->info.volume_flags & VOLUME_FLAG_ACTIVE_FAT) ? exfat->info.fat_length : 0);
+    exfat->cluster_offset_mask    = (1 << exfat->info.sectors_per_cluster_shift) - 1;
+    exfat->block_size             = block_size;
+    exfat->fat_entry_shift        = exfat->info.bytes_per_sector_shift - 2;
+    exfat->cluster_size           = block_size << exfat->info.sectors_per_cluster_shift;
+
+    reset_counters(&exfat->counters);
+
+    if (cache_init(&exfat->cache, &exfat->ops, cache_size, block_size) == false) {
+        free(exfat);
+        return EXFAT_OUT_OF_MEMORY;
+    }
+
+    if (dentry_cache_init(&exfat->dentries, DENTRY_CACHE_COUNT) == false) {
+        return abort_mount(exfat, EXFAT_OUT_OF_MEMORY);
+    }
+
+    exfat->readahead_max = limit_readahead(exfat, DEFAULT_READAHEAD_SIZE);
+    exfat->verify_checksums = (flags & EXFAT_MOUNT_VERIFY) != 0;
+
+    status = load_upcase_table(exfat);
+    if (status) return abort_mount(exfat, status);
+
+    exfat->ascii_upcase = is_ascii_upcase(exfat);
+
+    status = load_allocation_bitmap(exfat);
+    if (status) return abort_mount(exfat, status);
+
+    pthread_rwlock_init(&exfat->lock, 0);
+
+    // The volume is not visible to other threads until it is in the mount table.
+    pthread_rwlock_wrlock(&exfats_lock);
+    exfat_array_append(&exfats, exfat);
+    pthread_rwlock_unlock(&exfats_lock);
+
+    return EXFAT_OK;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+int exfat_mount(DiskOps* ops, u64 address, char* mountpoint, int cache_size, int flags) {
+    u8 data[MAX_BLOCK_SIZE];
+
+    u64 start = trace_begin(TRACE_MOUNT);
+    int status = read_boot_sector(ops, address, data);
+
+    if (status == EXFAT_OK) {
+        status = mount_volume(ops, address, (ExFatHeader *)data, mountpoint, cache_size, flags);
+    }
+
+    trace_end(TRACE_MOUNT, start);
+    return status;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Probes or mounts the volumes of exfat_mount_all. Every thread takes the next job until
+// none are left.
+static void* mount_worker(void* argument) {
+    MountAll* all = argument;
+
+    while (1) {
+        int index = atomic_fetch_add_explicit(&all->next_job, 1, memory_order_relaxed);
+
+        if (index >= all->job_count) {
+            return 0;
+        }
+
+        MountJob* job = &all->jobs[index];
+
+        if (all->probing) {
+            job->status = read_boot_sector(all->ops, job->address, job->boot_sector);
+            continue;
+        }
+
+        u64 start = trace_begin(TRACE_MOUNT);
+        job->status = mount_volume(all->ops, job->address, (ExFatHeader *)job->boot_sector, job->mountpoint, all->cache_size, all->flags);
+        trace_end(TRACE_MOUNT, start);
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Runs the jobs on up to MOUNT_MAX_THREADS threads, the calling thread included. If threads can not
+// be created the calling thread does the rest.
+static void run_mount_jobs(MountAll* all, bool probing) {
+    pthread_t threads[MOUNT_MAX_THREADS];
+    int thread_count = limit(all->job_count, MOUNT_MAX_THREADS);
+    int started = 0;
+
+    all->probing = probing;
+    atomic_store_explicit(&all->next_job, 0, memory_order_relaxed);
+
+    for (; started < thread_count - 1; started++) {
+        if (pthread_create(&threads[started], 0, mount_worker, all)) {
+            break;
+        }
+    }
+
+    mount_worker(all);
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], 0);
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Mounts every exFAT volume on the disk as prefix0, prefix1 and so on, in partition table order.
+// The boot sectors of all candidates are read at the same time, and the volumes found are then
+// mounted in parallel. GPT basic data partitions are candidates too, and the probe passes over the
+// ones holding another file system. A disk without exFAT partitions is tried as a single volume
+// starting at the first sector. Count is the number of volumes mounted, which are kept even if
+// another one fails.
+int exfat_mount_all(DiskOps* ops, const char* prefix, int cache_size, int flags, int* count) {
+    Disk* disk = malloc(sizeof(Disk));
+    MountJob* jobs = malloc(PARTITION_COUNT * sizeof(MountJob));
+    int job_count = 0;
+
+    *count = 0;
+
+    if (disk == 0 || jobs == 0) {
+        free(disk);
+        free(jobs);
+        return EXFAT_OUT_OF_MEMORY;
+    }
+
+    if (disk_read_partitions(ops, disk)) {
+        for (int i = 0; i < disk->partition_count; i++) {
+            int type = disk->partitions[i].type;
+
+            if (type == PARTITION_TYPE_EXFAT || type == PARTITION_TYPE_BASIC_DATA) {
+                jobs[job_count++].address = disk->partitions[i].address;
+            }
+        }
+    }
+
+    if (job_count == 0) {
+        jobs[job_count++].address = 0;
+    }
+
+    MountAll all = {
+        .ops        = ops,
+        .jobs       = jobs,
+        .job_count  = job_count,
+        .cache_size = cache_size,
+        .flags      = flags,
+    };
+
+    run_mount_jobs(&all, true);
+
+    // Only the volumes which passed the probe are mounted, so the names have no gaps.
+    all.job_count = 0;
+
+    for (int i = 0; i < job_count; i++) {
+        if (jobs[i].status == EXFAT_OK) {
+            MountJob* job = &jobs[all.job_count];
+
+            if (job != &jobs[i]) {
+                *job = jobs[i];
+            }
+
+            snprintf(job->mountpoint, sizeof(job->mountpoint), "%s%d", prefix, all.job_count++);
+        }
+    }
+
+    run_mount_jobs(&all, false);
+
+    int status = (all.job_count == 0) ? EXFAT_NO_EXFAT_VOLUME : EXFAT_OK;
+
+    for (int i = 0; i < all.job_count; i++) {
+        if (jobs[i].status == EXFAT_OK) {
+            (*count)++;
+        }
+        else if (status == EXFAT_OK) {
+            status = jobs[i].status;
+        }
+    }
+
+    free(disk);
+    free(jobs);
+    return status;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// The volume label must be at least VOLUME_LABEL_SIZE bytes.
+int exfat_get_volume_label(File* file, char* mountpoint, char* volume_label) {
+    String path = convert_to_string(mountpoint);
+
+    int status = find_volume_and_rewind_to_root_directory(file, &path, false);
+    if (status) return status;
+
+    status = move_window_to_primary_entry(ENTRY_TYPE_VOLUME_LABEL, file);
+    if (status < 0) return leave_volume(file, status);
+
+    VolumeLabelEntry* entry = get_window_pointer(file);
+    int length = limit(entry->label_length, VOLUME_LABEL_LENGTH);
+
+    utf16_to_utf8(entry->label, length, volume_label);
+    return leave_volume(file, EXFAT_OK);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// The label must be valid UTF-8 of at most eleven UTF-16 units.
+int exfat_set_volume_label(File* file, char* mountpoint, char* volume_label) {
+    String path = convert_to_string(mountpoint);
+    String label = convert_to_string(volume_label);
+
+    Unicode units[VOLUME_LABEL_LENGTH];
+    int length = utf8_to_utf16(label.text, label.length, units, VOLUME_LABEL_LENGTH);
+
+    if (length < 0) {
+        return EXFAT_INVALID_NAME;
+    }
+
+    int status = find_volume_and_rewind_to_root_directory(file, &path, true);
+    if (status) return status;
+
+    status = move_window_to_primary_entry(ENTRY_TYPE_VOLUME_LABEL, file);
+    if (status < 0) return leave_volume(file, status);
+
+    VolumeLabelEntry* entry = get_window_pointer(file);
+
+    for (int i = 0; i < length; i++) {
+        entry->label[i] = units[i];
+    }
+
+    entry->label_length = length;
+    cache_mark_dirty(&file->exfat->cache, file->window);
+
+    return leave_volume(file, sync_window(file));
+}
+
+//--------------------------------------------------------------------------------------------------
+
+int exfat_open_directory(File* file, char* path) {
+    String input_path = convert_to_string(path);
+    return follow_path(file, &input_path, true);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+int exfat_open_directory_at(File* directory, File* file, char* path) {
+    String input_path = convert_to_string(path);
+    return follow_path_at(directory, file, &input_path, true);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static void decode_primary_entry(const DirectoryEntry* dir_entry, FileInfo* info, int fields) {
+    if (fields & FILE_INFO_ATTRIBUTES) {
+        info->attributes = dir_entry->attributes;
+    }
+
+    if (fields & FILE_INFO_CREATE_TIME) {
+        convert_to_timestamp(&info->create_time, dir_entry->create_time, dir_entry->create_time_10ms, dir_entry->create_utc_offset);
+    }
+
+    if (fields & FILE_INFO_ACCESS_TIME) {
+        convert_to_timestamp(&info->access_time, dir_entry->access_time, 0, dir_entry->accessed_utc_offset);
+    }
+
+    if (fields & FILE_INFO_MODIFIED_TIME) {
+        convert_to_timestamp(&info->modified_time, dir_entry->modified_time, dir_entry->modified_time_10ms, dir_entry->modified_utc_offset);
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Decodes the selected fields of the next entry set in the directory. The first cluster and the
+// stream flags are returned as well, so that the entry can be followed without a lookup.
+static int read_directory(File* file, FileInfo* info, int fields, u32* first_cluster, u8* flags) {
+    int status = move_window_to_primary_entry(ENTRY_TYPE_DIRECTORY, file);
+    if (status) return status;
+
+    file->last_entry_address = file->window_address;
+    file->last_entry_index = file->window_index;
+    file->last_entry_valid = true;
+
+    DirectoryEntry* dir_entry = get_window_pointer(file);
+    decode_primary_entry(dir_entry, info, fields);
+
+    int secondary_count = dir_entry->secondary_count;
+
+    // The checksum is added up as the entries are decoded, so the entry set is only walked once.
+    bool verify = file->exfat->verify_checksums;
+    u16 expected = dir_entry->checksum;
+    u16 checksum = 0;
+
+    if (verify) {
+        checksum = compute_entry_checksum(0, (u8 *)dir_entry, true);
+    }
+
+    skip_directory_entries(file, 1);
+
+    StreamEntry* stream_entry = get_window_pointer(file);
+
+    if (stream_entry->type != ENTRY_TYPE_STREAM) {
+        return EXFAT_DIRECTORY_ENTRY_ERROR;
+    }
+
+    if (verify) {
+        checksum = compute_entry_checksum(checksum, (u8 *)stream_entry, false);
+    }
+
+    if (fields & FILE_INFO_LENGTH) {
+        info->length = stream_entry->length;
+    }
+
+    *first_cluster = stream_entry->first_cluster;
+    *flags = stream_entry->flags;
+
+    int name_length = stream_entry->name_length;
+
+    // Skip the stream entry.
+    skip_directory_entries(file, 1);
+    secondary_count--;
+
+    // Without the name, the name entries are passed over in one move, unless they are checksummed.
+    if ((fields & FILE_INFO_NAME) == 0) {
+        if (verify) {
+            status = checksum_directory_entries(file, secondary_count, &checksum);
+            if (status) return status;
+
+            return (checksum == expected) ? EXFAT_OK : EXFAT_CHECKSUM_ERROR;
+        }
+
+        if (secondary_count) {
+            skip_directory_entries(file, secondary_count);
+        }
+
+        return EXFAT_OK;
+    }
+
+    // A surrogate pair may be split between two name entries, so the name is gathered before it is
+    // converted.
+    Unicode name[MAX_NAME_LENGTH];
+    Unicode* name_pointer = name;
+
+    while (secondary_count) {
+        if (name_length == 0) {
+            return EXFAT_DIRECTORY_ENTRY_ERROR;
+        }
+
+        NameEntry* name_entry = get_window_pointer(file);
+
+        if (name_entry->type != ENTRY_TYPE_NAME) {
+            return EXFAT_DIRECTORY_ENTRY_ERROR;
+        }
+
+        if (verify) {
+            checksum = compute_entry_checksum(checksum, (u8 *)name_entry, false);
+        }
+
+        int size = limit(name_length, NAME_ENTRY_CHARACTERS);
+
+        for (int i = 0; i < size; i++) {
+            name_pointer[i] = name_entry->name[i];
+        }
+
+        name_length -= size;
+        name_pointer += size;
+
+        skip_directory_entries(file, 1);
+        secondary_count--;
+    }
+
+    utf16_to_utf8(name, name_pointer - name, info->filename);
+
+    if (secondary_count) {
+        skip_directory_entries(file, secondary_count);
+        return EXFAT_DIRECTORY_ENTRY_ERROR;
+    }
+
+    if (verify && checksum != expected) {
+        return EXFAT_CHECKSUM_ERROR;
+    }
+
+    return EXFAT_OK;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+int exfat_read_directory(File* file, FileInfo* info) {
+    u64 start = trace_begin(TRACE_READ_DIRECTORY);
+
+    enter_volume(file->exfat, false);
+    u32 first_cluster;
+    u8 flags;
+
+    int status = leave_volume(file, read_directory(file, info, FILE_INFO_ALL, &first_cluster, &flags));
+
+    trace_end(TRACE_READ_DIRECTORY, start);
+    return status;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Loads the rest of the cluster under the window with a single request. A directory without a FAT
+// chain is contiguous, so the request may reach further, up to the readahead size.
+static void prefetch_directory(File* file) {
+    ExFat* exfat = file->exfat;
+
+    u64 address = file->window_address;
+    u64 end = (address | exfat->cluster_offset_mask) + 1;
+
+    if (file->no_fat_chain) {
+        u64 directory_end = cluster_to_address(exfat, file->file_cluster + get_file_cluster_count(file));
+        u64 readahead_end = address + exfat->readahead_max / exfat->block_size;
+
+        if (readahead_end > end) {
+            end = limit(readahead_end, directory_end);
+        }
+    }
+
+    // This is only a hint. Errors show up when the window is loaded.
+    cache_prefetch(&exfat->cache, address, end - address);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Decodes an entry set which lies inside one sector, straight from the cache block. The name
+// entries must follow the stream entry, like read_directory expects.
+static int decode_entry_set(ExFat* exfat, const Entry* set, int count, FileInfo* info, int fields) {
+    const DirectoryEntry* dir_entry = (const DirectoryEntry *)&set[0];
+    const StreamEntry* stream_entry = (const StreamEntry *)&set[1];
+
+    if (count < 2 || stream_entry->type != ENTRY_TYPE_STREAM) {
+        return EXFAT_DIRECTORY_ENTRY_ERROR;
+    }
+
+    int name_length = stream_entry->name_length;
+    int name_count = count - 2;
+
+    if (name_count > (name_length + NAME_ENTRY_CHARACTERS - 1) / NAME_ENTRY_CHARACTERS) {
+        return EXFAT_DIRECTORY_ENTRY_ERROR;
+    }
+
+    if (exfat->verify_checksums) {
+        u16 checksum = compute_entry_checksum(0, (const u8 *)dir_entry, true);
+
+        for (int i = 1; i < count; i++) {
+            checksum = compute_entry_checksum(checksum, (const u8 *)&set[i], false);
+        }
+
+        if (checksum != dir_entry->checksum) {
+            return EXFAT_CHECKSUM_ERROR;
+        }
+    }
+
+    decode_primary_entry(dir_entry, info, fields);
+
+    if (fields & FILE_INFO_LENGTH) {
+        info->length = stream_entry->length;
+    }
+
+    if ((fields & FILE_INFO_NAME) == 0) {
+        return EXFAT_OK;
+    }
+
+    Unicode name[MAX_NAME_LENGTH];
+    int length = 0;
+
+    for (int i = 0; i < name_count; i++) {
+        const NameEntry* name_entry = (const NameEntry *)&set[2 + i];
+
+        if (name_entry->type != ENTRY_TYPE_NAME) {
+            return EXFAT_DIRECTORY_ENTRY_ERROR;
+        }
+
+        int size = limit(name_length - length, NAME_ENTRY_CHARACTERS);
+
+        for (int j = 0; j < size; j++) {
+            name[length + j] = name_entry->name[j];
+        }
+
+        length += size;
+    }
+
+    utf16_to_utf8(name, length, info->filename);
+    return EXFAT_OK;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Moves the window to the start of the next sector of the directory. The FAT is only read when the
+// sector is the last one in its cluster, and the new cluster is then prefetched as a whole.
+static int next_directory_sector(File* file) {
+    ExFat* exfat = file->exfat;
+    u64 address = file->window_address + 1;
+
+    if ((file->window_address & exfat->cluster_offset_mask) == exfat->cluster_offset_mask) {
+        u32 cluster = address_to_cluster(exfat, file->window_address);
+
+        int status = get_next_file_cluster(file, cluster, &cluster);
+        if (status) return status;
+
+        move_window_lazy(file, cluster_to_address(exfat, cluster));
+        prefetch_directory(file);
+        return cache_window(file);
+    }
+
+    file->window_index = 0;
+    return set_window_address(file, address);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Decodes up to max entry sets. The volume is locked once, and every entry set inside the pinned
+// sector is decoded in one pass over it. Only sets which cross into the next sector go through
+// read_directory. Only the fields selected by the mask are decoded. The entries decoded before an
+// error or the end of the directory are still returned.
+int exfat_read_directory_batch(File* file, FileInfo* info, int fields, int max, int* count) {
+    ExFat* exfat = file->exfat;
+    u32 block_size = exfat->block_size;
+    int decoded = 0;
+
+    enter_volume(exfat, false);
+
+    prefetch_directory(file);
+    int status = cache_window(file);
+
+    while (status == EXFAT_OK && decoded < max) {
+        const u8* data = file->window->data;
+        u32 index = file->window_index;
+        u32 start = index;
+
+        while (index < block_size && decoded < max) {
+            const Entry* entry = (const Entry *)&data[index];
+
+            if (entry->type == ENTRY_TYPE_END_OF_DIRECTORY) {
+                status = EXFAT_END_OF_FILE;
+                break;
+            }
+
+            if (entry->type != ENTRY_TYPE_DIRECTORY) {
+                index += sizeof(Entry);
+                continue;
+            }
+
+            int set_count = 1 + ((const DirectoryEntry *)entry)->secondary_count;
+
+            if (index + set_count * sizeof(Entry) > block_size) {
+                break;
+            }
+
+            file->last_entry_address = file->window_address;
+            file->last_entry_index = index;
+            file->last_entry_valid = true;
+
+            status = decode_entry_set(exfat, entry, set_count, &info[decoded], fields);
+            index += set_count * sizeof(Entry);
+
+            if (status) break;
+            decoded++;
+        }
+
+        file->entries_scanned += (index - start) / sizeof(Entry);
+
+        if (status || decoded == max) {
+            // The window must stay inside the sector. A finished sector leaves it on the last entry
+            // of the set just decoded, which the next call skips.
+            file->window_index = limit(index, block_size - sizeof(Entry));
+            break;
+        }
+
+        if (index < block_size) {
+            // The entry set crosses into the next sector.
+            u64 cluster_address = file->window_address | exfat->cluster_offset_mask;
+            u32 first_cluster;
+            u8 flags;
+
+            file->window_index = index;
+            status = read_directory(file, &info[decoded], fields, &first_cluster, &flags);
+            if (status) break;
+
+            decoded++;
+
+            if ((file->window_address | exfat->cluster_offset_mask) != cluster_address) {
+                prefetch_directory(file);
+            }
+
+            status = cache_window(file);
+            continue;
+        }
+
+        // The window stays on the last entry if the directory ends with this sector.
+        file->window_index = block_size - sizeof(Entry);
+        status = next_directory_sector(file);
+    }
+
+    // A directory does not need an end of directory entry if every entry is used.
+    if (status == EXFAT_END_OF_CLUSTER_CHAIN) {
+        status = EXFAT_END_OF_FILE;
+    }
+
+    *count = decoded;
+
+    if (decoded && status == EXFAT_END_OF_FILE) {
+        status = EXFAT_OK;
+    }
+
+    return leave_volume(file, status);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+int exfat_open_file(File* file, char* path) {
+    String input_path = convert_to_string(path);
+
+    u64 start = trace_begin(TRACE_OPEN_FILE);
+    int status = follow_path(file, &input_path, false);
+    trace_end(TRACE_OPEN_FILE, start);
+
+    return status;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+int exfat_open_file_at(File* directory, File* file, char* path) {
+    String input_path = convert_to_string(path);
+    return follow_path_at(directory, file, &input_path, false);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+int exfat_file_read(File* file, void* data, int size, int* bytes_written) {
+    u64 start = trace_begin(TRACE_FILE_READ);
+
+    enter_volume(file->exfat, false);
+    int status = leave_volume(file, read_file(file, data, size, bytes_written));
+
+    trace_end(TRACE_FILE_READ, start);
+    return status;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static int write_file(File* file, const void* data, int size, int* bytes_written) {
+    if (file->attributes & (FILE_ATTRIBUTES_DIRECTORY | FILE_ATTRIBUTES_READ_ONLY)) {
+        return EXFAT_ATTRIBUTE_ERROR;
+    }
+
+    if (size < 0) {
+        return EXFAT_FILE_OFFSET_OUT_OF_RANGE;
+    }
+
+    int status;
+
+    u64 offset = file->file_offset;
+    u64 end = offset + size;
+    u64 valid_length = file->valid_length;
+    bool stream_changed = false;
+
+    if (end > file->file_length) {
+        status = grow_file(file, end);
+        if (status) return status;
+
+        stream_changed = true;
+    }
+
+    status = EXFAT_OK;
+
+    // The data after the valid length is undefined on the disk, so the gap up to the write offset
+    // must be cleared before the valid length moves past it.
+    if (offset > file->valid_length) {
+        status = zero_file_data(file, file->valid_length, offset);
+    }
+
+    if (status == EXFAT_OK) {
+        file->file_offset = offset;
+        status = write_file_data(file, data, size);
+    }
+
+    // The file offset stops after the last byte written, also when the write fails part way. The
+    // entry set is then still updated, so the clusters added above are not lost.
+    if (file->file_offset > valid_length) {
+        file->valid_length = file->file_offset;
+        stream_changed = true;
+    }
+
+    if (stream_changed) {
+        int update_status = update_entry_set(file);
+
+        if (status == EXFAT_OK) {
+            status = update_status;
+        }
+    }
+
+    if (status) return status;
+
+    add_counter(&file->exfat->counters.bytes_written, size);
+
+    *bytes_written = size;
+    return EXFAT_OK;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Writes at the current file offset, growing the file if needed. The changes are held in the volume
+// cache until the file is flushed.
+int exfat_file_write(File* file, const void* data, int size, int* bytes_written) {
+    u64 start = trace_begin(TRACE_FILE_WRITE);
+
+    enter_volume(file->exfat, true);
+    int status = leave_volume(file, write_file(file, data, size, bytes_written));
+
+    trace_end(TRACE_FILE_WRITE, start);
+    return status;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static int allocate_file(File* file, u64 size) {
+    if (file->attributes & (FILE_ATTRIBUTES_DIRECTORY | FILE_ATTRIBUTES_READ_ONLY)) {
+        return EXFAT_ATTRIBUTE_ERROR;
+    }
+
+    if (size <= file->file_length) {
+        return EXFAT_OK;
+    }
+
+    int status = grow_file(file, size);
+    if (status) return status;
+
+    return update_entry_set(file);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Reserves clusters for the file up to the given size in the spirit of fallocate. The length is set
+// to the new size, while the valid length stays at the end of the written data. Files never shrink.
+int exfat_file_allocate(File* file, u64 size) {
+    enter_volume(file->exfat, true);
+    return leave_volume(file, allocate_file(file, size));
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static int map_file(File* file, u64 offset, u64 length, const void** pointer) {
+    if (offset > file->file_length || length > file->file_length - offset) {
+        return EXFAT_FILE_OFFSET_OUT_OF_RANGE;
+    }
+
+    ExFat* exfat = file->exfat;
+    u64 saved_offset = file->file_offset;
+    int status;
+
+    exfat_file_unmap(file);
+
+    if (exfat->ops.map && length && offset + length <= file->valid_length) {
+        u32 block_size = exfat->block_size;
+        u32 block_count = ((offset & (block_size - 1)) + length + block_size - 1) / block_size;
+        u64 address;
+        u32 count;
+
+        file->file_offset = offset;
+        status = get_sector_run(file, block_count, &address, &count);
+        file->file_offset = saved_offset;
+
+        if (status) return status;
+
+        if (count == block_count) {
+            // The mapping shows the disk, so changes still in the cache must be written first.
+            if (cache_flush_range(&exfat->cache, address, count) == false) {
+                return EXFAT_DISK_ERROR;
+            }
+
+            u64 start = trace_begin(TRACE_DISK_MAP);
+            const u8* data = exfat->ops.map(address, count);
+            trace_end(TRACE_DISK_MAP, start);
+
+            if (data) {
+                add_counter(&exfat->counters.bytes_read, length);
+
+                *pointer = data + (offset & (exfat->block_size - 1));
+                return EXFAT_OK;
+            }
+        }
+    }
+
+    file->map_copy = malloc(length ? length : 1);
+
+    if (file->map_copy == 0) {
+        return EXFAT_OUT_OF_MEMORY;
+    }
+
+    u8* data = file->map_copy;
+    file->file_offset = offset;
+
+    while (length) {
+        int size = limit(length, 1 << 30);
+        int read;
+
+        status = read_file(file, data, size, &read);
+
+        if (status) {
+            file->file_offset = saved_offset;
+            exfat_file_unmap(file);
+            return status;
+        }
+
+        data += read;
+        length -= read;
+    }
+
+    file->file_offset = saved_offset;
+    *pointer = file->map_copy;
+    return EXFAT_OK;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Returns a pointer to a range of the file. If the disk is mapped into memory and the range lies in
+// one physically contiguous run of written data, the pointer goes straight into the mapping.
+// Otherwise the range is copied into a buffer owned by the handle. The pointer is valid until the
+// next call to exfat_file_map or exfat_file_unmap on the handle, and changes made after the call
+// are not guaranteed to be seen through it.
+int exfat_file_map(File* file, u64 offset, u64 length, const void** pointer) {
+    enter_volume(file->exfat, false);
+    return leave_volume(file, map_file(file, offset, length, pointer));
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Frees the copy made by exfat_file_map, if any. Must be called before a handle with a mapped range
+// is reopened or dropped.
+void exfat_file_unmap(File* file) {
+    free(file->map_copy);
+    file->map_copy = 0;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Frees the memory held by the handle, which is the extent map of a fragmented file and the copy
+// made by exfat_file_map. Must be called before a handle is dropped, or opened again other than in
+// place with exfat_open_file_at or exfat_open_directory_at.
+void exfat_close(File* file) {
+    exfat_file_unmap(file);
+    release_extents(file);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+int exfat_set_file_offset(File* file, u64 offset) {
+    u64 start = trace_begin(TRACE_SET_FILE_OFFSET);
+
+    enter_volume(file->exfat, false);
+    int status = leave_volume(file, set_file_offset(file, offset));
+
+    trace_end(TRACE_SET_FILE_OFFSET, start);
+    return status;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+int exfat_flush(File* file) {
+    enter_volume(file->exfat, false);
+    return leave_volume(file, sync_window(file));
+}
+
+//--------------------------------------------------------------------------------------------------
+
+int exfat_statfs(char* mountpoint, ExFatStatfs* statfs) {
+    String path = convert_to_string(mountpoint);
+    ExFat* exfat = get_volume_from_path(&path);
+
+    if (exfat == 0) {
+        return EXFAT_WRONG_MOUNTPOINT_IN_PATH;
+    }
+
+    // The chunk summaries are brought up to date, which changes the volume.
+    enter_volume(exfat, true);
+
+    int status = update_space_info(exfat);
+
+    if (status == EXFAT_OK) {
+        statfs->cluster_size = exfat->cluster_size;
+        statfs->total_clusters = exfat->info.cluster_count;
+        statfs->free_clusters = exfat->free_clusters;
+        statfs->largest_free_run = exfat->largest_free_run;
+    }
+
+    pthread_rwlock_unlock(&exfat->lock);
+    return status;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Sets the largest readahead window for files on the volume. The window is limited by the cache
+// size, and a size of zero turns readahead off.
+int exfat_set_readahead(char* mountpoint, u32 size) {
+    String path = convert_to_string(mountpoint);
+    ExFat* exfat = get_volume_from_path(&path);
+
+    if (exfat == 0) {
+        return EXFAT_WRONG_MOUNTPOINT_IN_PATH;
+    }
+
+    enter_volume(exfat, true);
+    exfat->readahead_max = limit_readahead(exfat, size);
+    pthread_rwlock_unlock(&exfat->lock);
+
+    return EXFAT_OK;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// The counters are read one at a time while other threads keep adding to them, so the numbers are
+// not an exact snapshot of a single moment.
+int exfat_get_stats(char* mountpoint, ExFatStats* stats) {
+    String path = convert_to_string(mountpoint);
+    ExFat* exfat = get_volume_from_path(&path);
+
+    if (exfat == 0) {
+        return EXFAT_WRONG_MOUNTPOINT_IN_PATH;
+    }
+
+    VolumeCounters* counters = &exfat->counters;
+    CacheStats cache;
+    cache_get_stats(&exfat->cache, &cache);
+
+    stats->sector_reads    = cache.sector_reads + atomic_load_explicit(&counters->sector_reads, memory_order_relaxed);
+    stats->sector_writes   = cache.sector_writes + atomic_load_explicit(&counters->sector_writes, memory_order_relaxed);
+    stats->read_requests   = cache.read_requests + atomic_load_explicit(&counters->read_requests, memory_order_relaxed);
+    stats->write_requests  = cache.write_requests + atomic_load_explicit(&counters->write_requests, memory_order_relaxed);
+    stats->bytes_read      = atomic_load_explicit(&counters->bytes_read, memory_order_relaxed);
+    stats->bytes_written   = atomic_load_explicit(&counters->bytes_written, memory_order_relaxed);
+    stats->fat_lookups     = atomic_load_explicit(&counters->fat_lookups, memory_order_relaxed);
+    stats->cache_hits      = cache.hits;
+    stats->cache_misses    = cache.misses;
+    stats->entries_scanned = atomic_load_explicit(&counters->entries_scanned, memory_order_relaxed);
+    stats->path_lookups    = atomic_load_explicit(&counters->path_lookups, memory_order_relaxed);
+    stats->dentry_hits     = atomic_load_explicit(&counters->dentry_hits, memory_order_relaxed);
+
+    return EXFAT_OK;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+int exfat_reset_stats(char* mountpoint) {
+    String path = convert_to_string(mountpoint);
+    ExFat* exfat = get_volume_from_path(&path);
+
+    if (exfat == 0) {
+        return EXFAT_WRONG_MOUNTPOINT_IN_PATH;
+    }
+
+    reset_counters(&exfat->counters);
+    cache_reset_stats(&exfat->cache);
+
+    return EXFAT_OK;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static bool queue_init(WalkQueue* queue) {
+    queue->tasks = malloc(WALK_QUEUE_SIZE * sizeof(WalkTask));
+    queue->head = 0;
+    queue->tail = 0;
+    queue->capacity = WALK_QUEUE_SIZE;
+
+    if (queue->tasks == 0) {
+        return false;
+    }
+
+    pthread_mutex_init(&queue->lock, 0);
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static void queue_destroy(WalkQueue* queue) {
+    while (queue->head != queue->tail) {
+        free(queue->tasks[queue->head++ & (queue->capacity - 1)].path);
+    }
+
+    pthread_mutex_destroy(&queue->lock);
+    free(queue->tasks);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static bool queue_push(WalkQueue* queue, WalkTask* task) {
+    pthread_mutex_lock(&queue->lock);
+
+    if (queue->tail - queue->head == queue->capacity) {
+        WalkTask* tasks = malloc(2 * queue->capacity * sizeof(WalkTask));
+
+        if (tasks == 0) {
+            pthread_mutex_unlock(&queue->lock);
+            return false;
+        }
+
+        for (u32 i = 0; i < queue->capacity; i++) {
+            tasks[i] = queue->tasks[(queue->head + i) & (queue->capacity - 1)];
+        }
+
+        free(queue->tasks);
+        queue->tasks = tasks;
+        queue->tail = queue->capacity;
+        queue->head = 0;
+        queue->capacity *= 2;
+    }
+
+    queue->tasks[queue->tail++ & (queue->capacity - 1)] = *task;
+
+    pthread_mutex_unlock(&queue->lock);
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static bool queue_pop(WalkQueue* queue, WalkTask* task, bool steal) {
+    pthread_mutex_lock(&queue->lock);
+
+    bool found = queue->head != queue->tail;
+
+    if (found && steal) {
+        *task = queue->tasks[queue->head++ & (queue->capacity - 1)];
+    }
+    else if (found) {
+        *task = queue->tasks[--queue->tail & (queue->capacity - 1)];
+    }
+
+    pthread_mutex_unlock(&queue->lock);
+    return found;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static void wake_workers(Walk* walk) {
+    pthread_mutex_lock(&walk->lock);
+    pthread_cond_broadcast(&walk->wake);
+    pthread_mutex_unlock(&walk->lock);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Ends the walk early. Only the first error is kept.
+static void stop_walk(Walk* walk, int status) {
+    pthread_mutex_lock(&walk->lock);
+
+    if (walk->status == EXFAT_OK) {
+        walk->status = status;
+    }
+
+    atomic_store(&walk->stop, true);
+    pthread_cond_broadcast(&walk->wake);
+    pthread_mutex_unlock(&walk->lock);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static bool push_task(WalkWorker* worker, WalkTask* task) {
+    Walk* walk = worker->walk;
+    atomic_fetch_add(&walk->pending, 1);
+
+    if (queue_push(&worker->queue, task) == false) {
+        atomic_fetch_sub(&walk->pending, 1);
+        return false;
+    }
+
+    // An idle worker counts itself before it checks the queued count, so one of the two sides
+    // always sees the other.
+    atomic_fetch_add(&walk->queued, 1);
+
+    if (atomic_load(&walk->idle)) {
+        wake_workers(walk);
+    }
+
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Takes a task from the worker's own queue, or steals one from another worker.
+static bool take_task(WalkWorker* worker, WalkTask* task) {
+    Walk* walk = worker->walk;
+
+    for (int i = 0; i < walk->worker_count; i++) {
+        WalkWorker* victim = &walk->workers[(worker->index + i) % walk->worker_count];
+
+        if (queue_pop(&victim->queue, task, victim != worker)) {
+            atomic_fetch_sub(&walk->queued, 1);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Returns a new path with the name appended to the parent. Without a parent, the name is copied.
+static char* join_path(char* parent, char* name) {
+    String second = convert_to_string(name);
+    int offset = 0;
+
+    if (parent) {
+        offset = convert_to_string(parent).length + 1;
+    }
+
+    char* path = malloc(offset + second.length + 1);
+    if (path == 0) {
+        return 0;
+    }
+
+    if (parent) {
+        memory_copy(parent, path, offset - 1);
+        path[offset - 1] = EXFAT_PATH_DELIMITER;
+    }
+
+    memory_copy(second.text, path + offset, second.length);
+    path[offset + second.length] = 0;
+
+    return path;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Hands every entry in the directory to the callback, and queues the subdirectories which are not
+// pruned. The volume is only held while a batch of entries is decoded, so writers get in between
+// batches and the callback is free to use the volume.
+static int walk_directory(WalkWorker* worker, WalkTask* task) {
+    Walk* walk = worker->walk;
+    ExFat* exfat = walk->exfat;
+
+    File directory;
+    directory.exfat = exfat;
+    directory.window_valid = false;
+    directory.map_copy = 0;
+    directory.extra_extents = 0;
+    directory.extra_capacity = 0;
+    directory.entries_scanned = 0;
+    set_file_stream(&directory, task->first_cluster, task->length, task->length, task->flags);
+    directory.attributes = FILE_ATTRIBUTES_DIRECTORY;
+
+    int status = EXFAT_OK;
+    bool first_batch = true;
+
+    while (status == EXFAT_OK && atomic_load(&walk->stop) == false) {
+        int count = 0;
+
+        enter_volume(exfat, false);
+
+        // The directory is read one sector at a time through the window, so the start of it
+        // is loaded with a few large requests first. This is only a hint, and errors are left
+        // to the scan.
+        if (first_batch && task->length) {
+            prefetch_file_range(&directory, 0, limit(task->length, exfat->readahead_max));
+        }
+
+        while (count < WALK_BATCH_SIZE) {
+            WalkEntry* entry = &worker->entries[count];
+
+            status = read_directory(&directory, &entry->info, walk->fields, &entry->first_cluster, &entry->flags);
+            if (status) break;
+
+            count++;
+        }
+
+        leave_volume(&directory, status);
+        first_batch = false;
+
+        for (int i = 0; i < count; i++) {
+            WalkEntry* entry = &worker->entries[i];
+
+            char* path = join_path(task->path, entry->info.filename);
+            if (path == 0) {
+                release_extents(&directory);
+                return EXFAT_OUT_OF_MEMORY;
+            }
+
+            int action = walk->callback(path, &entry->info, entry->first_cluster, walk->context);
+
+            if (action == EXFAT_WALK_STOP) {
+                free(path);
+                release_extents(&directory);
+                stop_walk(walk, EXFAT_OK);
+                return EXFAT_OK;
+            }
+
+            bool descend = action == EXFAT_WALK_CONTINUE && (entry->info.attributes & FILE_ATTRIBUTES_DIRECTORY) && entry->first_cluster >= 2;
+
+            if (descend == false) {
+                free(path);
+                continue;
+            }
+
+            WalkTask child = {
+                .path          = path,
+                .first_cluster = entry->first_cluster,
+                .length        = entry->info.length,
+                .flags         = entry->flags,
+            };
+
+            if (push_task(worker, &child) == false) {
+                free(path);
+                release_extents(&directory);
+                return EXFAT_OUT_OF_MEMORY;
+            }
+        }
+    }
+
+    release_extents(&directory);
+    return (status == EXFAT_END_OF_FILE) ? EXFAT_OK : status;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static void* run_worker(void* argument) {
+    WalkWorker* worker = argument;
+    Walk* walk = worker->walk;
+
+    while (atomic_load(&walk->stop) == false) {
+        WalkTask task;
+
+        if (take_task(worker, &task)) {
+            int status = walk_directory(worker, &task);
+            free(task.path);
+
+            if (status) {
+                stop_walk(walk, status);
+            }
+
+            if (atomic_fetch_sub(&walk->pending, 1) == 1) {
+                wake_workers(walk);
+            }
+
+            continue;
+        }
+
+        pthread_mutex_lock(&walk->lock);
+        atomic_fetch_add(&walk->idle, 1);
+
+        while (atomic_load(&walk->queued) == 0 && atomic_load(&walk->pending) && atomic_load(&walk->stop) == false) {
+            pthread_cond_wait(&walk->wake, &walk->lock);
+        }
+
+        atomic_fetch_sub(&walk->idle, 1);
+        bool done = atomic_load(&walk->pending) == 0;
+        pthread_mutex_unlock(&walk->lock);
+
+        if (done) {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Calls the callback for every file and directory below the directory at the path, which might be
+// just a mountpoint, using up to the given number of threads. Every directory is a task, and idle
+// threads steal tasks from busy ones. The callback runs on all the threads at once and decides
+// whether a directory is entered. The path handed to it is only valid during the call. The fields
+// select what is decoded into the info, and the name, length and attributes are always included.
+int exfat_walk(char* path, int fields, ExFatWalkCallback callback, void* context, int threads) {
+    File start;
+    String input_path = convert_to_string(path);
+
+    int status = follow_path(&start, &input_path, true);
+    if (status) return status;
+
+    // Only the stream of the start directory is used from here on.
+    release_extents(&start);
+    ExFat* exfat = start.exfat;
+
+    threads = (threads < 1) ? 1 : limit(threads, WALK_MAX_THREADS);
+
+    Walk walk;
+    walk.exfat = exfat;
+    walk.callback = callback;
+    walk.context = context;
+    walk.fields = fields | FILE_INFO_NAME | FILE_INFO_LENGTH | FILE_INFO_ATTRIBUTES;
+    walk.worker_count = 0;
+    walk.status = EXFAT_OK;
+    atomic_init(&walk.pending, 0);
+    atomic_init(&walk.queued, 0);
+    atomic_init(&walk.idle, 0);
+    atomic_init(&walk.stop, false);
+    pthread_mutex_init(&walk.lock, 0);
+    pthread_cond_init(&walk.wake, 0);
+
+    walk.workers = malloc(threads * sizeof(WalkWorker));
+    status = (walk.workers == 0) ? EXFAT_OUT_OF_MEMORY : EXFAT_OK;
+
+    for (int i = 0; i < threads && status == EXFAT_OK; i++) {
+        WalkWorker* worker = &walk.workers[i];
+        worker->walk = &walk;
+        worker->index = i;
+
+        if (queue_init(&worker->queue) == false) {
+            status = EXFAT_OUT_OF_MEMORY;
+            break;
+        }
+
+        walk.worker_count++;
+    }
+
+    WalkTask root = {
+        .path          = join_path(0, path),
+        .first_cluster = start.file_cluster,
+        .length        = start.file_length,
+        .flags         = start.no_fat_chain ? STREAM_FLAG_NO_FAT_CHAIN : 0,
+    };
+
+    if (status == EXFAT_OK && root.path) {
+        // Paths handed to the callback are built from this one, so it should not end
+        // with a delimiter.
+        for (int i = input_path.length - 1; i > 0 && root.path[i] == EXFAT_PATH_DELIMITER; i--) {
+            root.path[i] = 0;
+        }
+
+        // The path is freed below with the other error cases.
+        if (push_task(&walk.workers[0], &root) == false) {
+            status = EXFAT_OUT_OF_MEMORY;
+        }
+    }
+    else if (status == EXFAT_OK) {
+        status = EXFAT_OUT_OF_MEMORY;
+    }
+
+    if (status == EXFAT_OK) {
+        int started = 1;
+
+        // The calling thread is the first worker. If a thread can not be started, its queue simply
+        // stays empty.
+        for (; started < walk.worker_count; started++) {
+            if (pthread_create(&walk.workers[started].thread, 0, run_worker, &walk.workers[started])) {
+                break;
+            }
+        }
+
+        run_worker(&walk.workers[0]);
+
+        for (int i = 1; i < started; i++) {
+            pthread_join(walk.workers[i].thread, 0);
+        }
+
+        status = walk.status;
+    }
+    else {
+        free(root.path);
+    }
+
+    for (int i = 0; i < walk.worker_count; i++) {
+        queue_destroy(&walk.workers[i].queue);
+    }
+
+    free(walk.workers);
+    pthread_cond_destroy(&walk.wake);
+    pthread_mutex_destroy(&walk.lock);
+
+    return status;
 }
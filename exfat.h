@@ -5,12 +5,21 @@
 
 #include "utilities.h"
 #include "disk.h"
+#include "cache.h"
 
 //--------------------------------------------------------------------------------------------------
 
 #define MOUNTPOINT_NAME_SIZE    64
 #define NAME_ENTRY_CHARACTERS   15
-#define MAX_FILE_NAME_LENGTH    257
+// Names and labels are returned as UTF-8. Every UTF-16 unit of a name, of which there are up to
+// 255, takes up to three bytes.
+#define MAX_FILE_NAME_LENGTH    (255 * 3 + 1)
+#define VOLUME_LABEL_SIZE       (11 * 3 + 1)
+#define DEFAULT_CACHE_SIZE      (64 * 1024)
+#define FILE_EXTENT_COUNT       32
+#define DEFAULT_READAHEAD_SIZE  (128 * 1024)
+#define MIN_READAHEAD_SIZE      (4 * 1024)
+#define WALK_MAX_THREADS        64
 
 //--------------------------------------------------------------------------------------------------
 
@@ -32,6 +41,24 @@ enum {
     EXFAT_DIRECTORY_ENTRY_ERROR       = -13,
 
     EXFAT_WRONG_MOUNTPOINT_IN_PATH    = -14,
+    EXFAT_OUT_OF_MEMORY               = -15,
+    EXFAT_DISK_FULL                   = -16,
+    EXFAT_SECTOR_SIZE_ERROR           = -17,
+    EXFAT_CHECKSUM_ERROR              = -18,
+    EXFAT_INVALID_NAME                = -19,
+};
+
+// Passed to exfat_mount and exfat_mount_all. Verify checks the boot region checksum at mount, and
+// the checksum of every entry set as it is read.
+enum {
+    EXFAT_MOUNT_VERIFY = 1 << 0,
+};
+
+// Returned by the exfat_walk callback. Skip leaves out the contents of a directory.
+enum {
+    EXFAT_WALK_CONTINUE = 0,
+    EXFAT_WALK_SKIP     = 1,
+    EXFAT_WALK_STOP     = 2,
 };
 
 enum {
@@ -42,18 +69,37 @@ enum {
     FILE_ATTRIBUTES_ARCHIVE    = 1 << 5,
 };
 
+// Selects the FileInfo fields decoded by exfat_read_directory_batch and exfat_walk. Fields which
+// are not selected are left unchanged.
+enum {
+    FILE_INFO_NAME          = 1 << 0,
+    FILE_INFO_LENGTH        = 1 << 1,
+    FILE_INFO_ATTRIBUTES    = 1 << 2,
+    FILE_INFO_CREATE_TIME   = 1 << 3,
+    FILE_INFO_ACCESS_TIME   = 1 << 4,
+    FILE_INFO_MODIFIED_TIME = 1 << 5,
+
+    FILE_INFO_ALL           = 0x3F,
+};
+
 //--------------------------------------------------------------------------------------------------
 
 typedef struct ExFat ExFat;
 
+typedef struct {
+    u32 file_cluster;
+    u32 disk_cluster;
+    u32 length;
+} Extent;
+
 typedef struct {
     ExFat* exfat;
 
-    u8 window[BLOCK_SIZE];
+    // The window references a block in the volume cache instead of owning a buffer.
+    CacheBlock* window;
 
     bool window_valid;
-    bool window_dirty;
-    u32  window_address;
+    u64  window_address;
     int  window_index;
 
     // @Cleanup: I do not know if we need to store all these fields.
@@ -63,6 +109,45 @@ typedef struct {
     u64 valid_length;
     u32 file_cluster;
     u64 parent_file_address;
+    u16 attributes;
+    bool no_fat_chain;
+
+    // Location of the entry set last returned by exfat_read_directory.
+    bool last_entry_valid;
+    u64  last_entry_address;
+    int  last_entry_index;
+
+    // The entry set describing the file, and the stream of the directory holding it. These are used
+    // to write the stream entry back when the file grows.
+    u64  entry_address;
+    int  entry_index;
+    u16  name_hash;
+    u32  parent_cluster;
+    u64  parent_length;
+    bool parent_no_fat_chain;
+
+    // Physically contiguous cluster runs of the file. These are built lazily as the cluster chain
+    // is walked, so that seeking never has to walk the same part of the chain twice. The first runs
+    // are kept in the handle, and the rest in memory which is freed by exfat_close.
+    Extent extents[FILE_EXTENT_COUNT];
+    Extent* extra_extents;
+    int extra_capacity;
+    int extent_count;
+    u32 cursor_index;
+    u32 cursor_cluster;
+
+    // Sequential read detection. The readahead window doubles every time a sequential stream runs
+    // past the prefetched data, up to the limit of the volume.
+    u64 readahead_next;
+    u64 readahead_end;
+    u32 readahead_size;
+
+    // Directory entries stepped over during the current call. They are added to the volume counters
+    // when the call returns, so the walk over a directory does not touch shared memory per entry.
+    u32 entries_scanned;
+
+    // Copy handed out by exfat_file_map when the range could not be mapped directly.
+    void* map_copy;
 } File;
 
 typedef struct {
@@ -87,17 +172,74 @@ typedef struct {
     Timestamp modified_time;
 } FileInfo;
 
+typedef int (*ExFatWalkCallback)(const char* path, const FileInfo* info, u32 first_cluster, void* context);
+
+typedef struct {
+    u32 cluster_size;
+    u32 total_clusters;
+    u32 free_clusters;
+    u32 largest_free_run;
+} ExFatStatfs;
+
+// Counted since the volume was mounted or the counters were last reset. Sector and request counts
+// cover both the cache and the transfers which bypass it.
+typedef struct {
+    u64 sector_reads;
+    u64 sector_writes;
+    u64 read_requests;
+    u64 write_requests;
+    u64 bytes_read;
+    u64 bytes_written;
+    u64 fat_lookups;
+    u64 cache_hits;
+    u64 cache_misses;
+    u64 entries_scanned;
+    u64 path_lookups;
+    u64 dentry_hits;
+} ExFatStats;
+
 //--------------------------------------------------------------------------------------------------
 
+// Threading model
+//
+// A mounted volume can be used from many threads at once. The mount table and every volume have
+// a reader-writer lock. Calls which only read from a volume hold its lock shared, so reads of
+// files and directories on the same volume run in parallel. Writing, allocating, setting the
+// volume label, exfat_statfs and exfat_set_readahead hold it exclusively. The block cache and
+// the dentry cache of a volume have their own locks, and sectors missing from the cache are read
+// without holding them.
+//
+// A handle must only be used by one thread at a time. The exception is the directory passed to
+// exfat_open_file_at and exfat_open_directory_at, which is only read when it is not also the output
+// handle. A handle does not see changes to the file made through other handles after it was opened.
+// The extent map of a fragmented file grows on the heap, and is freed by exfat_close.
+//
+// exfat_init must be called before any other thread uses the library. The disk operations are
+// called from several threads at once, and must be safe for that.
+
 void exfat_init();
-int exfat_mount(DiskOps* ops, u32 address, char* mountpoint);
+int exfat_mount(DiskOps* ops, u64 address, char* mountpoint, int cache_size, int flags);
+int exfat_mount_all(DiskOps* ops, const char* prefix, int cache_size, int flags, int* count);
 int exfat_get_volume_label(File* file, char* mountpoint, char* volume_label);
 int exfat_set_volume_label(File* file, char* mountpoint, char* volume_label);
 int exfat_open_directory(File* file, char* path);
+int exfat_open_directory_at(File* directory, File* file, char* path);
 int exfat_read_directory(File* file, FileInfo* info);
+int exfat_read_directory_batch(File* file, FileInfo* info, int fields, int max, int* count);
 int exfat_open_file(File* file, char* path);
+int exfat_open_file_at(File* directory, File* file, char* path);
 int exfat_file_read(File* file, void* data, int size, int* bytes_written);
+int exfat_file_write(File* file, const void* data, int size, int* bytes_written);
+int exfat_file_allocate(File* file, u64 size);
+int exfat_file_map(File* file, u64 offset, u64 length, const void** pointer);
+void exfat_file_unmap(File* file);
+void exfat_close(File* file);
 int exfat_set_file_offset(File* file, u64 offset);
 int exfat_flush(File* file);
+int exfat_statfs(char* mountpoint, ExFatStatfs* statfs);
+int exfat_set_readahead(char* mountpoint, u32 size);
+int exfat_get_stats(char* mountpoint, ExFatStats* stats);
+int exfat_reset_stats(char* mountpoint);
+int exfat_walk(char* path, int fields, ExFatWalkCallback callback, void* context, int threads);
 
 #endif
@@ -0,0 +1,585 @@
+// Author: strawberryhacker
+
+#define _GNU_SOURCE
+
+#include "stdlib.h"
+#include "string.h"
+#include "errno.h"
+#include "fcntl.h"
+#include "unistd.h"
+#include "pthread.h"
+#include "sys/mman.h"
+#include "sys/stat.h"
+#include "sys/ioctl.h"
+#include "linux/fs.h"
+#include "sys/syscall.h"
+#include "linux/io_uring.h"
+
+// The kernel headers define their own block size.
+#undef BLOCK_SIZE
+
+#include "host.h"
+
+//--------------------------------------------------------------------------------------------------
+
+typedef struct {
+    int fd;
+    u32 entries;
+
+    u32* sq_head;
+    u32* sq_tail;
+    u32* sq_mask;
+    u32* sq_array;
+    u32* cq_head;
+    u32* cq_tail;
+    u32* cq_mask;
+
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+
+    void* sq_ring;
+    void* cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+} Ring;
+
+// The part of a transfer which one submission queue entry still has to move.
+typedef struct {
+    u8* data;
+    u64 offset;
+    u32 length;
+} RingRequest;
+
+typedef struct {
+    int fd;
+    int mode;
+    int flags;
+    u32 block_size;
+
+    // The ring and the bounce buffer are shared by every thread using the device.
+    Ring ring;
+    pthread_mutex_t ring_lock;
+
+    // The whole device is mapped in the mmap mode.
+    u8* mapping;
+    u64 mapping_size;
+
+    // O_DIRECT transfers need aligned memory. Unaligned caller buffers go through this one.
+    u8* bounce;
+    pthread_mutex_t bounce_lock;
+} Host;
+
+//--------------------------------------------------------------------------------------------------
+
+// The disk operations carry no context, so the host backend serves a single device at a time.
+static Host host = {
+    .fd          = -1,
+    .ring_lock   = PTHREAD_MUTEX_INITIALIZER,
+    .bounce_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+//--------------------------------------------------------------------------------------------------
+
+static int io_uring_setup(u32 entries, struct io_uring_params* params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static int io_uring_enter(int fd, u32 submit, u32 complete, u32 flags) {
+    return syscall(__NR_io_uring_enter, fd, submit, complete, flags, 0, 0);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static void ring_destroy(Ring* ring) {
+    if (ring->sqes) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+
+    if (ring->cq_ring && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+
+    if (ring->sq_ring) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+
+    close(ring->fd);
+    memset(ring, 0, sizeof(Ring));
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Sets up the submission and completion rings without liburing. Kernels with a single mapping for
+// both rings report it through the feature flags.
+static bool ring_init(Ring* ring, u32 entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(Ring));
+
+    ring->fd = io_uring_setup(entries, &params);
+
+    if (ring->fd < 0) {
+        return false;
+    }
+
+    ring->entries = params.sq_entries;
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(u32);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+    }
+
+    ring->sq_ring = mmap(0, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+
+    if (ring->sq_ring == MAP_FAILED) {
+        ring->sq_ring = 0;
+        ring_destroy(ring);
+        return false;
+    }
+
+    ring->cq_ring = ring->sq_ring;
+
+    if ((params.features & IORING_FEAT_SINGLE_MMAP) == 0) {
+        ring->cq_ring = mmap(0, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+
+        if (ring->cq_ring == MAP_FAILED) {
+            ring->cq_ring = 0;
+            ring_destroy(ring);
+            return false;
+        }
+    }
+
+    ring->sqes = mmap(0, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = 0;
+        ring_destroy(ring);
+        return false;
+    }
+
+    u8* sq = ring->sq_ring;
+    u8* cq = ring->cq_ring;
+
+    ring->sq_head  = (u32 *)(sq + params.sq_off.head);
+    ring->sq_tail  = (u32 *)(sq + params.sq_off.tail);
+    ring->sq_mask  = (u32 *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (u32 *)(sq + params.sq_off.array);
+    ring->cq_head  = (u32 *)(cq + params.cq_off.head);
+    ring->cq_tail  = (u32 *)(cq + params.cq_off.tail);
+    ring->cq_mask  = (u32 *)(cq + params.cq_off.ring_mask);
+    ring->cqes     = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Waits for the next completion, and removes it from the completion queue.
+static bool reap_completion(Ring* ring, struct io_uring_cqe* result) {
+    u32 head = *ring->cq_head;
+
+    while (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        if (io_uring_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+            return false;
+        }
+    }
+
+    *result = ring->cqes[head & *ring->cq_mask];
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Splits the transfer into requests of at most HOST_REQUEST_SIZE bytes. As many requests as the
+// ring holds are submitted and waited for together. Every submitted request is reaped before
+// returning, so no stale completion is left for the next transfer. Requests which move fewer bytes
+// than asked are submitted again for the rest.
+static bool submit_and_wait(bool write, u64 offset, u8* data, u64 size) {
+    Ring* ring = &host.ring;
+    RingRequest requests[HOST_QUEUE_DEPTH];
+    u32 max_count = limit(ring->entries, HOST_QUEUE_DEPTH);
+    u32 pending = 0;
+
+    while (size || pending) {
+        u32 count = pending;
+
+        while (size && count < max_count) {
+            u32 length = limit(size, HOST_REQUEST_SIZE);
+
+            requests[count].data = data;
+            requests[count].offset = offset;
+            requests[count].length = length;
+
+            count++;
+            data += length;
+            offset += length;
+            size -= length;
+        }
+
+        u32 tail = *ring->sq_tail;
+
+        for (u32 i = 0; i < count; i++) {
+            u32 index = (tail + i) & *ring->sq_mask;
+
+            struct io_uring_sqe* sqe = &ring->sqes[index];
+            memset(sqe, 0, sizeof(*sqe));
+
+            sqe->opcode    = write ? IORING_OP_WRITE : IORING_OP_READ;
+            sqe->fd        = host.fd;
+            sqe->addr      = (u64)(uintptr_t)requests[i].data;
+            sqe->len       = requests[i].length;
+            sqe->off       = requests[i].offset;
+            sqe->user_data = i;
+
+            ring->sq_array[index] = index;
+        }
+
+        __atomic_store_n(ring->sq_tail, tail + count, __ATOMIC_RELEASE);
+
+        // The kernel may consume only part of the queue. Only the entries left are submitted again.
+        u32 submitted = 0;
+        bool success = true;
+
+        while (submitted < count) {
+            int result = io_uring_enter(ring->fd, count - submitted, 0, 0);
+
+            if (result < 0 && errno == EINTR) {
+                continue;
+            }
+
+            if (result <= 0) {
+                success = false;
+                break;
+            }
+
+            submitted += result;
+        }
+
+        // Entries the kernel never consumed are taken back out of the queue. Without SQPOLL the
+        // kernel only reads the queue inside io_uring_enter, so this is safe.
+        __atomic_store_n(ring->sq_tail, tail + submitted, __ATOMIC_RELEASE);
+
+        for (u32 i = 0; i < submitted; i++) {
+            struct io_uring_cqe cqe;
+
+            if (reap_completion(ring, &cqe) == false) {
+                return false;
+            }
+
+            RingRequest* request = &requests[cqe.user_data];
+
+            if (cqe.res <= 0) {
+                success = false;
+                continue;
+            }
+
+            request->data += cqe.res;
+            request->offset += cqe.res;
+            request->length -= cqe.res;
+        }
+
+        if (success == false) {
+            return false;
+        }
+
+        // Short requests are moved to the front, and are submitted first in the next round.
+        pending = 0;
+
+        for (u32 i = 0; i < count; i++) {
+            if (requests[i].length) {
+                requests[pending++] = requests[i];
+            }
+        }
+    }
+
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// A single thread drives the ring at a time.
+static bool ring_transfer(bool write, u64 offset, u8* data, u64 size) {
+    pthread_mutex_lock(&host.ring_lock);
+    bool success = submit_and_wait(write, offset, data, size);
+    pthread_mutex_unlock(&host.ring_lock);
+
+    return success;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static bool pread_transfer(bool write, u64 offset, u8* data, u64 size) {
+    while (size) {
+        ssize_t count = write ? pwrite(host.fd, data, size, offset) : pread(host.fd, data, size, offset);
+
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (count <= 0) {
+            return false;
+        }
+
+        data += count;
+        offset += count;
+        size -= count;
+    }
+
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// A read-only device is mapped without PROT_WRITE, so a write would fault instead of failing.
+static bool map_transfer(bool write, u64 offset, u8* data, u64 size) {
+    if (offset > host.mapping_size || size > host.mapping_size - offset) {
+        return false;
+    }
+
+    if (write && (host.flags & HOST_FLAG_READ_ONLY)) {
+        return false;
+    }
+
+    if (write) {
+        memcpy(host.mapping + offset, data, size);
+    }
+    else {
+        memcpy(data, host.mapping + offset, size);
+    }
+
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static bool raw_transfer(bool write, u64 offset, u8* data, u64 size) {
+    if (host.mode == HOST_MODE_MMAP) {
+        return map_transfer(write, offset, data, size);
+    }
+
+    if (host.mode == HOST_MODE_IO_URING) {
+        return ring_transfer(write, offset, data, size);
+    }
+
+    return pread_transfer(write, offset, data, size);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Offsets are computed in 64 bits, so images larger than 4 GiB work.
+static bool transfer(bool write, u64 address, u32 count, u8* data) {
+    u64 offset = (u64)address * host.block_size;
+    u64 size = (u64)count * host.block_size;
+
+    if ((host.flags & HOST_FLAG_DIRECT) == 0 || ((uintptr_t)data & (HOST_ALIGNMENT - 1)) == 0) {
+        return raw_transfer(write, offset, data, size);
+    }
+
+    bool success = true;
+
+    pthread_mutex_lock(&host.bounce_lock);
+
+    while (size && success) {
+        u64 length = limit(size, HOST_BOUNCE_SIZE);
+
+        if (write) {
+            memcpy(host.bounce, data, length);
+        }
+
+        success = raw_transfer(write, offset, host.bounce, length);
+
+        if (success && write == false) {
+            memcpy(data, host.bounce, length);
+        }
+
+        data += length;
+        offset += length;
+        size -= length;
+    }
+
+    pthread_mutex_unlock(&host.bounce_lock);
+    return success;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static bool host_read(u64 address, u8* data) {
+    return transfer(false, address, 1, data);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static bool host_write(u64 address, const u8* data) {
+    return transfer(true, address, 1, (u8 *)data);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static bool host_read_blocks(u64 address, u32 count, u8* data) {
+    return transfer(false, address, count, data);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static bool host_write_blocks(u64 address, u32 count, const u8* data) {
+    return transfer(true, address, count, (u8 *)data);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static const u8* host_map(u64 address, u32 count) {
+    u64 offset = (u64)address * host.block_size;
+    u64 size = (u64)count * host.block_size;
+
+    if (offset > host.mapping_size || size > host.mapping_size - offset) {
+        return 0;
+    }
+
+    return host.mapping + offset;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Maps the whole device. The size is found by seeking to the end, which works for
+// block devices too.
+static bool map_device() {
+    off_t size = lseek(host.fd, 0, SEEK_END);
+
+    if (size <= 0) {
+        return false;
+    }
+
+    int protection = PROT_READ | ((host.flags & HOST_FLAG_READ_ONLY) ? 0 : PROT_WRITE);
+    void* mapping = mmap(0, size, protection, MAP_SHARED, host.fd, 0);
+
+    if (mapping == MAP_FAILED) {
+        return false;
+    }
+
+    host.mapping = mapping;
+    host.mapping_size = size;
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Block devices report their logical sector size. An image file does not, and is taken to have
+// 512-byte sectors.
+static u32 get_block_size() {
+    struct stat status;
+    int size;
+
+    if (fstat(host.fd, &status) == 0 && S_ISBLK(status.st_mode) && ioctl(host.fd, BLKSSZGET, &size) == 0) {
+        return size;
+    }
+
+    return BLOCK_SIZE;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Opens an image file or a block device and fills in the disk operations for it. Only one device
+// can be open at a time. A block size of zero uses the sector size of the device.
+bool host_open(const char* path, int mode, int flags, u32 block_size, DiskOps* ops) {
+    if (host.fd >= 0) {
+        return false;
+    }
+
+    int open_flags = O_CLOEXEC;
+    open_flags |= (flags & HOST_FLAG_READ_ONLY) ? O_RDONLY : O_RDWR;
+    // Direct I/O does not apply to a mapped device.
+    if (mode == HOST_MODE_MMAP) {
+        flags &= ~HOST_FLAG_DIRECT;
+    }
+
+    open_flags |= (flags & HOST_FLAG_DIRECT) ? O_DIRECT : 0;
+
+    host.fd = open(path, open_flags);
+    host.mode = mode;
+    host.flags = flags;
+    host.bounce = 0;
+    host.mapping = 0;
+    host.mapping_size = 0;
+
+    if (host.fd < 0) {
+        return false;
+    }
+
+    host.block_size = block_size ? block_size : get_block_size();
+
+    if (host.block_size < BLOCK_SIZE || host.block_size > MAX_BLOCK_SIZE) {
+        host_close();
+        return false;
+    }
+
+    if ((flags & HOST_FLAG_DIRECT) && posix_memalign((void **)&host.bounce, HOST_ALIGNMENT, HOST_BOUNCE_SIZE)) {
+        host.bounce = 0;
+        host_close();
+        return false;
+    }
+
+    if (mode == HOST_MODE_IO_URING && ring_init(&host.ring, HOST_QUEUE_DEPTH) == false) {
+        host.mode = HOST_MODE_PREAD;
+        host_close();
+        return false;
+    }
+
+    if (mode == HOST_MODE_MMAP && map_device() == false) {
+        host_close();
+        return false;
+    }
+
+    ops->block_size   = host.block_size;
+    ops->read         = host_read;
+    ops->write        = host_write;
+    ops->read_blocks  = host_read_blocks;
+    ops->write_blocks = host_write_blocks;
+    ops->map          = (mode == HOST_MODE_MMAP) ? host_map : 0;
+
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Makes sure everything written has reached the device before closing it.
+bool host_close() {
+    if (host.fd < 0) {
+        return false;
+    }
+
+    bool success = true;
+
+    if (host.mapping && (host.flags & HOST_FLAG_READ_ONLY) == 0) {
+        success = msync(host.mapping, host.mapping_size, MS_SYNC) == 0;
+    }
+
+    if (host.mapping) {
+        munmap(host.mapping, host.mapping_size);
+    }
+
+    if ((host.flags & HOST_FLAG_READ_ONLY) == 0) {
+        success = (fsync(host.fd) == 0) && success;
+    }
+
+    if (host.mode == HOST_MODE_IO_URING) {
+        ring_destroy(&host.ring);
+    }
+
+    free(host.bounce);
+    close(host.fd);
+
+    host.fd = -1;
+    host.bounce = 0;
+    host.mapping = 0;
+
+    return success;
+}
@@ -0,0 +1,34 @@
+// Author: strawberryhacker
+
+#ifndef HOST_H
+#define HOST_H
+
+#include "utilities.h"
+#include "disk.h"
+
+//--------------------------------------------------------------------------------------------------
+
+#define HOST_QUEUE_DEPTH    32
+#define HOST_REQUEST_SIZE   (128 * 1024)
+#define HOST_ALIGNMENT      4096
+#define HOST_BOUNCE_SIZE    (1024 * 1024)
+
+//--------------------------------------------------------------------------------------------------
+
+enum {
+    HOST_MODE_PREAD,
+    HOST_MODE_IO_URING,
+    HOST_MODE_MMAP,
+};
+
+enum {
+    HOST_FLAG_DIRECT    = 1 << 0,
+    HOST_FLAG_READ_ONLY = 1 << 1,
+};
+
+//--------------------------------------------------------------------------------------------------
+
+bool host_open(const char* path, int mode, int flags, u32 block_size, DiskOps* ops);
+bool host_close();
+
+#endif
@@ -0,0 +1,678 @@
+// Author: strawberryhacker
+
+#include "image.h"
+#include "array.h"
+#include "disk.h"
+#include "stdio.h"
+#include "string.h"
+
+//--------------------------------------------------------------------------------------------------
+
+#define FAT_OFFSET              128
+#define BOOT_REGION_SECTORS     12
+#define ENTRY_SIZE              32
+#define NAME_CHARACTERS         15
+#define MAX_GAP_CLUSTERS        8
+
+// Percent chance of a gap before each cluster of /fragmented.bin, whatever
+// the configured fragmentation.
+#define FRAGMENTED_FILE_FRAGMENTATION  60
+
+#define ATTRIBUTE_DIRECTORY     0x10
+#define ATTRIBUTE_ARCHIVE       0x20
+
+#define FLAG_ALLOCATION_POSSIBLE 0x01
+#define FLAG_NO_FAT_CHAIN        0x02
+
+#define END_OF_CHAIN            0xFFFFFFFF
+
+//--------------------------------------------------------------------------------------------------
+
+define_array(cluster_array, ClusterArray, u32);
+define_array(byte_array, ByteArray, u8);
+
+typedef struct {
+    const ImageConfig* config;
+    u64 random;
+    u32 next_cluster;
+
+    // The FAT is indexed by cluster. The heap holds the clusters from cluster 2
+    // onwards, gaps included.
+    ClusterArray fat;
+    ByteArray heap;
+} Builder;
+
+//--------------------------------------------------------------------------------------------------
+
+static const char* volume_label = "BENCH";
+
+//--------------------------------------------------------------------------------------------------
+
+static inline void put_u16(u8* data, u16 value) {
+    data[0] = value;
+    data[1] = value >> 8;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static inline void put_u32(u8* data, u32 value) {
+    put_u16(data, value);
+    put_u16(data + 2, value >> 16);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static inline void put_u64(u8* data, u64 value) {
+    put_u32(data, value);
+    put_u32(data + 4, value >> 32);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static u64 next_random(Builder* builder) {
+    builder->random ^= builder->random >> 12;
+    builder->random ^= builder->random << 25;
+    builder->random ^= builder->random >> 27;
+    return builder->random * 0x2545F4914F6CDD1DULL;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static u32 compute_boot_checksum(const u8* data, int size) {
+    u32 checksum = 0;
+
+    for (int i = 0; i < size; i++) {
+        if (i == 106 || i == 107 || i == 112) {
+            continue;
+        }
+
+        checksum = ((checksum & 1) ? 0x80000000 : 0) + (checksum >> 1) + data[i];
+    }
+
+    return checksum;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static u32 compute_table_checksum(const u8* data, int size) {
+    u32 checksum = 0;
+
+    for (int i = 0; i < size; i++) {
+        checksum = ((checksum & 1) ? 0x80000000 : 0) + (checksum >> 1) + data[i];
+    }
+
+    return checksum;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static u16 compute_set_checksum(const u8* data, int size) {
+    u16 checksum = 0;
+
+    for (int i = 0; i < size; i++) {
+        if (i == 2 || i == 3) {
+            continue;
+        }
+
+        checksum = ((checksum & 1) ? 0x8000 : 0) + (checksum >> 1) + data[i];
+    }
+
+    return checksum;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Names are plain ASCII, so only a-z need to be up-cased for the hash.
+static u16 compute_name_hash(const char* name, int length) {
+    u16 hash = 0;
+
+    for (int i = 0; i < length; i++) {
+        u8 c = name[i];
+
+        if (c >= 'a' && c <= 'z') {
+            c -= 'a' - 'A';
+        }
+
+        hash = ((hash & 1) ? 0x8000 : 0) + (hash >> 1) + c;
+        hash = ((hash & 1) ? 0x8000 : 0) + (hash >> 1);
+    }
+
+    return hash;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static u32 random_timestamp(Builder* builder) {
+    u64 random = next_random(builder);
+
+    u32 year   = 35 + random % 10;
+    u32 month  = 1 + (random >> 8) % 12;
+    u32 day    = 1 + (random >> 16) % 28;
+    u32 hour   = (random >> 24) % 24;
+    u32 minute = (random >> 32) % 60;
+    u32 second = (random >> 40) % 30;
+
+    return (year << 25) | (month << 21) | (day << 16) | (hour << 11) | (minute << 5) | second;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static inline u8* get_cluster_data(Builder* builder, u32 cluster) {
+    return &builder->heap.items[(u64)(cluster - 2) * builder->config->cluster_size];
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Makes room for every cluster up to the next free one. New clusters are zero, which also makes
+// them valid empty directories.
+static void grow_volume(Builder* builder) {
+    u32 cluster_size = builder->config->cluster_size;
+
+    int fat_count = builder->next_cluster;
+    int heap_size = (builder->next_cluster - 2) * cluster_size;
+
+    cluster_array_extend(&builder->fat, fat_count);
+    memset(&builder->fat.items[builder->fat.count], 0, (fat_count - builder->fat.count) * sizeof(u32));
+    builder->fat.count = fat_count;
+
+    byte_array_extend(&builder->heap, heap_size);
+    memset(&builder->heap.items[builder->heap.count], 0, heap_size - builder->heap.count);
+    builder->heap.count = heap_size;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Hands out count clusters and links them in the FAT. Fragmentation is the percent chance of a gap
+// before each cluster, and the gaps stay free. Returns true if the clusters are consecutive.
+static bool allocate_clusters(Builder* builder, u32 count, u32 fragmentation, ClusterArray* clusters) {
+    clusters->count = 0;
+    cluster_array_extend(clusters, count);
+
+    for (u32 i = 0; i < count; i++) {
+        if (i && (next_random(builder) % 100) < fragmentation) {
+            builder->next_cluster += 1 + next_random(builder) % MAX_GAP_CLUSTERS;
+        }
+
+        clusters->items[clusters->count++] = builder->next_cluster++;
+    }
+
+    grow_volume(builder);
+
+    for (u32 i = 0; i < count; i++) {
+        builder->fat.items[clusters->items[i]] = (i + 1 < count) ? clusters->items[i + 1] : END_OF_CHAIN;
+    }
+
+    return count == 0 || clusters->items[count - 1] - clusters->items[0] == count - 1;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static void write_clusters(Builder* builder, ClusterArray* clusters, const u8* data, u64 size) {
+    u32 cluster_size = builder->config->cluster_size;
+
+    for (int i = 0; i < clusters->count && size; i++) {
+        u32 chunk = limit(size, cluster_size);
+
+        memcpy(get_cluster_data(builder, clusters->items[i]), data, chunk);
+
+        data += chunk;
+        size -= chunk;
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static void append_entry_set(Builder* builder, ByteArray* directory, const char* name, u16 attributes, u32 first_cluster, u64 length, u8 flags) {
+    int name_length = limit((int)strlen(name), 255);
+    int secondary_count = 1 + (name_length + NAME_CHARACTERS - 1) / NAME_CHARACTERS;
+    int size = (secondary_count + 1) * ENTRY_SIZE;
+
+    byte_array_extend(directory, directory->count + size);
+
+    u8* set = &directory->items[directory->count];
+    memset(set, 0, size);
+    directory->count += size;
+
+    u32 time = random_timestamp(builder);
+
+    set[0] = 0x85;
+    set[1] = secondary_count;
+    put_u16(set + 4, attributes);
+    put_u32(set + 8, time);
+    put_u32(set + 12, time);
+    put_u32(set + 16, time);
+
+    u8* stream = set + ENTRY_SIZE;
+    stream[0] = 0xC0;
+    stream[1] = flags;
+    stream[3] = name_length;
+    put_u16(stream + 4, compute_name_hash(name, name_length));
+    put_u64(stream + 8, length);
+    put_u32(stream + 20, first_cluster);
+    put_u64(stream + 24, length);
+
+    for (int i = 0; i < name_length; i++) {
+        u8* entry = set + (2 + i / NAME_CHARACTERS) * ENTRY_SIZE;
+
+        entry[0] = 0xC1;
+        put_u16(entry + 2 + 2 * (i % NAME_CHARACTERS), (u8)name[i]);
+    }
+
+    put_u16(set + 2, compute_set_checksum(set, size));
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Stores the entries in their own clusters. The directory always gets at least one cluster, and the
+// zeros after the last entry mark the end of it.
+static void write_directory(Builder* builder, ByteArray* entries, bool fragment, u32* first_cluster, u64* length, u8* flags) {
+    u32 cluster_size = builder->config->cluster_size;
+    u32 count = (entries->count + cluster_size - 1) / cluster_size;
+
+    if (count == 0) {
+        count = 1;
+    }
+
+    ClusterArray clusters;
+    cluster_array_init(&clusters, count);
+
+    bool contiguous = allocate_clusters(builder, count, fragment ? builder->config->fragmentation : 0, &clusters);
+    write_clusters(builder, &clusters, entries->items, entries->count);
+
+    *first_cluster = clusters.items[0];
+    *length = (u64)count * cluster_size;
+    *flags = FLAG_ALLOCATION_POSSIBLE | (contiguous ? FLAG_NO_FAT_CHAIN : 0);
+
+    free(clusters.items);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static void write_file(Builder* builder, ByteArray* directory, const char* name, u32 file_number, u64 size, u32 fragmentation) {
+    u32 cluster_size = builder->config->cluster_size;
+    u32 count = (size + cluster_size - 1) / cluster_size;
+
+    if (count == 0) {
+        append_entry_set(builder, directory, name, ATTRIBUTE_ARCHIVE, 0, 0, FLAG_ALLOCATION_POSSIBLE);
+        return;
+    }
+
+    ClusterArray clusters;
+    cluster_array_init(&clusters, count);
+
+    bool contiguous = allocate_clusters(builder, count, fragmentation, &clusters);
+    u64 offset = 0;
+
+    for (u32 i = 0; i < count; i++) {
+        u8* data = get_cluster_data(builder, clusters.items[i]);
+
+        for (u32 j = 0; j < cluster_size && offset < size; j++, offset++) {
+            data[j] = image_file_byte(file_number, offset);
+        }
+    }
+
+    u8 flags = FLAG_ALLOCATION_POSSIBLE | (contiguous ? FLAG_NO_FAT_CHAIN : 0);
+    append_entry_set(builder, directory, name, ATTRIBUTE_ARCHIVE, clusters.items[0], size, flags);
+
+    free(clusters.items);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static u32 get_tree_directory_count(const ImageConfig* config) {
+    u64 count = 1;
+    u64 level = 1;
+
+    for (u32 i = 0; i < config->depth && count < 0xFFFFFFFF; i++) {
+        level *= config->fan_out;
+        count += level;
+    }
+
+    return limit(count, 0xFFFFFFFF);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Directories are numbered in the order they are built, and file i lands in directory i modulo the
+// directory count.
+static void build_tree(Builder* builder, u32 level, u32* number, u32 directory_count, u32* first_cluster, u64* length, u8* flags) {
+    const ImageConfig* config = builder->config;
+    u32 directory_number = (*number)++;
+    char name[32];
+
+    ByteArray entries;
+    byte_array_init(&entries, 1024);
+
+    if (level < config->depth) {
+        for (u32 i = 0; i < config->fan_out; i++) {
+            u32 child_cluster;
+            u64 child_length;
+            u8 child_flags;
+
+            build_tree(builder, level + 1, number, directory_count, &child_cluster, &child_length, &child_flags);
+
+            snprintf(name, sizeof(name), "dir_%03u", i);
+            append_entry_set(builder, &entries, name, ATTRIBUTE_DIRECTORY, child_cluster, child_length, child_flags);
+        }
+    }
+
+    u32 size_range = config->max_file_size - config->min_file_size + 1;
+
+    for (u32 i = directory_number; i < config->file_count; i += directory_count) {
+        u64 size = config->min_file_size + next_random(builder) % size_range;
+
+        snprintf(name, sizeof(name), "file_%07u.dat", i);
+        write_file(builder, &entries, name, i + 1, size, config->fragmentation);
+    }
+
+    write_directory(builder, &entries, true, first_cluster, length, flags);
+    free(entries.items);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static void build_deep_chain(Builder* builder, u32 level, u32* first_cluster, u64* length, u8* flags) {
+    char name[32];
+
+    ByteArray entries;
+    byte_array_init(&entries, 256);
+
+    if (level == builder->config->deep_depth) {
+        append_entry_set(builder, &entries, "leaf.txt", ATTRIBUTE_ARCHIVE, 0, 0, FLAG_ALLOCATION_POSSIBLE);
+    }
+    else {
+        u32 child_cluster;
+        u64 child_length;
+        u8 child_flags;
+
+        build_deep_chain(builder, level + 1, &child_cluster, &child_length, &child_flags);
+
+        snprintf(name, sizeof(name), "d%02u", level);
+        append_entry_set(builder, &entries, name, ATTRIBUTE_DIRECTORY, child_cluster, child_length, child_flags);
+    }
+
+    write_directory(builder, &entries, true, first_cluster, length, flags);
+    free(entries.items);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static void build_wide_directory(Builder* builder, u32* first_cluster, u64* length, u8* flags) {
+    char name[32];
+
+    ByteArray entries;
+    byte_array_init(&entries, 1024);
+
+    for (u32 i = 0; i < builder->config->wide_count; i++) {
+        snprintf(name, sizeof(name), "entry_%07u.txt", i);
+        append_entry_set(builder, &entries, name, ATTRIBUTE_ARCHIVE, 0, 0, FLAG_ALLOCATION_POSSIBLE);
+    }
+
+    write_directory(builder, &entries, true, first_cluster, length, flags);
+    free(entries.items);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// The table only maps a-z, and the runs mapping to themselves are compressed.
+static void build_upcase_table(Builder* builder, u32* first_cluster, u32* checksum, u32* size) {
+    u8 table[(4 + 26) * sizeof(u16)];
+    u8* p = table;
+
+    put_u16(p, 0xFFFF);
+    put_u16(p + 2, 'a');
+    p += 4;
+
+    for (int c = 'A'; c <= 'Z'; c++, p += 2) {
+        put_u16(p, c);
+    }
+
+    put_u16(p, 0xFFFF);
+    put_u16(p + 2, 0x10000 - 'z' - 1);
+
+    ClusterArray clusters;
+    cluster_array_init(&clusters, 1);
+
+    allocate_clusters(builder, 1, 0, &clusters);
+    write_clusters(builder, &clusters, table, sizeof(table));
+
+    *first_cluster = clusters.items[0];
+    *checksum = compute_table_checksum(table, sizeof(table));
+    *size = sizeof(table);
+
+    free(clusters.items);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static void write_boot_region(const ImageConfig* config, u8* region, u64 volume_length, u32 fat_length, u32 heap_offset, u32 cluster_count, u32 root_cluster, u32 used_clusters) {
+    u8* boot = region;
+    u32 sector_size = config->sector_size;
+    u32 cluster_shift = __builtin_ctz(config->cluster_size / sector_size);
+
+    boot[0] = 0xEB;
+    boot[1] = 0x76;
+    boot[2] = 0x90;
+    memcpy(boot + 3, "EXFAT   ", 8);
+
+    put_u64(boot + 64, IMAGE_PARTITION_ADDRESS);
+    put_u64(boot + 72, volume_length);
+    put_u32(boot + 80, FAT_OFFSET);
+    put_u32(boot + 84, fat_length);
+    put_u32(boot + 88, heap_offset);
+    put_u32(boot + 92, cluster_count);
+    put_u32(boot + 96, root_cluster);
+    put_u32(boot + 100, 0x12340000 | (config->seed & 0xFFFF));
+    put_u16(boot + 104, 0x0100);
+    put_u16(boot + 106, 0);
+    boot[108] = __builtin_ctz(sector_size);
+    boot[109] = cluster_shift;
+    boot[110] = 1;
+    boot[111] = 0x80;
+    boot[112] = (u64)used_clusters * 100 / cluster_count;
+    put_u16(boot + 510, 0xAA55);
+
+    // The extended boot sectors only carry a signature.
+    for (int i = 1; i <= 8; i++) {
+        put_u32(region + i * sector_size + sector_size - 4, 0xAA550000);
+    }
+
+    u32 checksum = compute_boot_checksum(region, 11 * sector_size);
+
+    for (int i = 0; i < sector_size; i += 4) {
+        put_u32(region + 11 * sector_size + i, checksum);
+    }
+
+    memcpy(region + BOOT_REGION_SECTORS * sector_size, region, BOOT_REGION_SECTORS * sector_size);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void image_default_config(ImageConfig* config) {
+    config->sector_size          = BLOCK_SIZE;
+    config->cluster_size         = 4096;
+    config->file_count           = 2000;
+    config->fan_out              = 4;
+    config->depth                = 3;
+    config->min_file_size        = 0;
+    config->max_file_size        = 64 * 1024;
+    config->large_file_size      = 32 * 1024 * 1024;
+    config->fragmented_file_size = 8 * 1024 * 1024;
+    config->wide_count           = 10000;
+    config->deep_depth           = 16;
+    config->fragmentation        = 0;
+    config->free_clusters        = 4096;
+    config->seed                 = 1;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// The content of every file follows from its number and the offset, so reads can be checked.
+u8 image_file_byte(u32 file_number, u64 offset) {
+    u64 value = (offset >> 2) * 0x9E3779B1 + file_number * 0x85EBCA77;
+    return (value >> 24) ^ offset;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+bool image_generate(const ImageConfig* config, Image* image) {
+    u32 cluster_size = config->cluster_size;
+    u32 sector_size = config->sector_size;
+
+    if (sector_size < BLOCK_SIZE || sector_size > MAX_BLOCK_SIZE || (sector_size & (sector_size - 1))) {
+        return false;
+    }
+
+    if (cluster_size < sector_size || cluster_size > 32 * 1024 * 1024 || (cluster_size & (cluster_size - 1))) {
+        return false;
+    }
+
+    if (config->min_file_size > config->max_file_size || config->fragmentation > 100) {
+        return false;
+    }
+
+    Builder builder;
+    builder.config = config;
+    builder.random = 0x9E3779B97F4A7C15ULL ^ config->seed;
+    builder.next_cluster = 2;
+    cluster_array_init(&builder.fat, 1024);
+    byte_array_init(&builder.heap, 1024 * 1024);
+    builder.fat.count = 0;
+    builder.heap.count = 0;
+    grow_volume(&builder);
+
+    // The root directory goes last, since it points to everything else.
+    u32 upcase_cluster, upcase_checksum, upcase_size;
+    build_upcase_table(&builder, &upcase_cluster, &upcase_checksum, &upcase_size);
+
+    ByteArray root;
+    byte_array_init(&root, 1024);
+    root.count = 3 * ENTRY_SIZE;
+    memset(root.items, 0, root.count);
+
+    u32 first_cluster;
+    u64 length;
+    u8 flags;
+    u32 number = 0;
+
+    build_tree(&builder, 0, &number, get_tree_directory_count(config), &first_cluster, &length, &flags);
+    append_entry_set(&builder, &root, "tree", ATTRIBUTE_DIRECTORY, first_cluster, length, flags);
+
+    write_file(&builder, &root, "large.bin", 0, config->large_file_size, config->fragmentation);
+    write_file(&builder, &root, "fragmented.bin", 0, config->fragmented_file_size, FRAGMENTED_FILE_FRAGMENTATION);
+
+    for (u32 i = 0; i < INGEST_FILE_COUNT; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "ingest_%u.bin", i);
+        write_file(&builder, &root, name, 0, 0, 0);
+    }
+
+    build_wide_directory(&builder, &first_cluster, &length, &flags);
+    append_entry_set(&builder, &root, "wide", ATTRIBUTE_DIRECTORY, first_cluster, length, flags);
+
+    build_deep_chain(&builder, 0, &first_cluster, &length, &flags);
+    append_entry_set(&builder, &root, "deep", ATTRIBUTE_DIRECTORY, first_cluster, length, flags);
+
+    // The bitmap must cover itself and the root directory as well.
+    u32 root_clusters = (root.count + cluster_size - 1) / cluster_size;
+    u32 bitmap_clusters = 1;
+    u32 cluster_count;
+
+    while (1) {
+        cluster_count = (builder.next_cluster - 2) + bitmap_clusters + root_clusters + config->free_clusters;
+
+        if ((u64)bitmap_clusters * cluster_size * 8 >= cluster_count) {
+            break;
+        }
+
+        bitmap_clusters++;
+    }
+
+    ClusterArray bitmap;
+    cluster_array_init(&bitmap, bitmap_clusters);
+    allocate_clusters(&builder, bitmap_clusters, 0, &bitmap);
+
+    u8* label = &root.items[0];
+    label[0] = 0x83;
+    label[1] = strlen(volume_label);
+
+    for (int i = 0; volume_label[i]; i++) {
+        put_u16(label + 2 + 2 * i, (u8)volume_label[i]);
+    }
+
+    u8* bitmap_entry = &root.items[ENTRY_SIZE];
+    bitmap_entry[0] = 0x81;
+    put_u32(bitmap_entry + 20, bitmap.items[0]);
+    put_u64(bitmap_entry + 24, (cluster_count + 7) / 8);
+
+    u8* upcase_entry = &root.items[2 * ENTRY_SIZE];
+    upcase_entry[0] = 0x82;
+    put_u32(upcase_entry + 4, upcase_checksum);
+    put_u32(upcase_entry + 20, upcase_cluster);
+    put_u64(upcase_entry + 24, upcase_size);
+
+    u32 root_cluster;
+    write_directory(&builder, &root, false, &root_cluster, &length, &flags);
+    free(root.items);
+
+    // Every cluster with a FAT entry is in use. The gaps left by fragmentation are not.
+    u32 used_clusters = 0;
+    u8* bitmap_data = get_cluster_data(&builder, bitmap.items[0]);
+
+    for (u32 cluster = 2; cluster < builder.next_cluster; cluster++) {
+        if (builder.fat.items[cluster]) {
+            bitmap_data[(cluster - 2) / 8] |= 1 << ((cluster - 2) % 8);
+            used_clusters++;
+        }
+    }
+
+    free(bitmap.items);
+
+    // Lay out the partition. The FAT and the cluster heap follow the boot regions.
+    u32 sectors_per_cluster = cluster_size / sector_size;
+    u32 fat_length = ((u64)(cluster_count + 2) * 4 + sector_size - 1) / sector_size;
+    u32 heap_offset = (FAT_OFFSET + fat_length + sectors_per_cluster - 1) & ~(sectors_per_cluster - 1);
+    u64 volume_length = heap_offset + (u64)cluster_count * sectors_per_cluster;
+
+    image->size = (IMAGE_PARTITION_ADDRESS + volume_length) * sector_size;
+    image->cluster_count = cluster_count;
+    image->data = calloc(1, image->size);
+
+    if (image->data == 0) {
+        free(builder.fat.items);
+        free(builder.heap.items);
+        return false;
+    }
+
+    u8* mbr = image->data;
+    mbr[446 + 0] = 0x80;
+    mbr[446 + 4] = 0x07;
+    put_u32(mbr + 446 + 8, IMAGE_PARTITION_ADDRESS);
+    put_u32(mbr + 446 + 12, volume_length);
+    put_u16(mbr + 510, 0xAA55);
+
+    u8* volume = image->data + (u64)IMAGE_PARTITION_ADDRESS * sector_size;
+    write_boot_region(config, volume, volume_length, fat_length, heap_offset, cluster_count, root_cluster, used_clusters);
+
+    u8* fat = volume + (u64)FAT_OFFSET * sector_size;
+    put_u32(fat, 0xFFFFFFF8);
+    put_u32(fat + 4, 0xFFFFFFFF);
+
+    for (u32 cluster = 2; cluster < builder.next_cluster; cluster++) {
+        put_u32(fat + cluster * 4, builder.fat.items[cluster]);
+    }
+
+    memcpy(volume + (u64)heap_offset * sector_size, builder.heap.items, builder.heap.count);
+
+    free(builder.fat.items);
+    free(builder.heap.items);
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void image_free(Image* image) {
+    free(image->data);
+    image->data = 0;
+    image->size = 0;
+}
@@ -0,0 +1,61 @@
+// Author: strawberryhacker
+
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include "utilities.h"
+
+//--------------------------------------------------------------------------------------------------
+
+#define IMAGE_PARTITION_ADDRESS  2048
+#define INGEST_FILE_COUNT        3
+
+//--------------------------------------------------------------------------------------------------
+
+// Describes a synthetic disk image. The same configuration always gives the same image.
+//
+// The volume holds the following:
+//   /tree       a tree of directories, fan_out wide and depth levels deep, with the files spread
+//               evenly over every directory in it
+//   /large.bin  one large file for sequential and random reads
+//   /fragmented.bin  the start of large.bin, always stored with heavy fragmentation
+//   /ingest_N.bin  INGEST_FILE_COUNT empty files for appending to
+//   /wide       a single directory with wide_count empty files
+//   /deep       a chain of deep_depth nested directories ending in leaf.txt
+typedef struct {
+    // Addresses in the MBR and the boot sector count sectors of this size.
+    u32 sector_size;
+    u32 cluster_size;
+    u32 file_count;
+    u32 fan_out;
+    u32 depth;
+    u32 min_file_size;
+    u32 max_file_size;
+    u64 large_file_size;
+    u64 fragmented_file_size;
+    u32 wide_count;
+    u32 deep_depth;
+
+    // Percent chance, per cluster, that the allocator leaves a gap before the next cluster
+    // of a file.
+    u32 fragmentation;
+
+    // Clusters left free at the end of the volume.
+    u32 free_clusters;
+    u32 seed;
+} ImageConfig;
+
+typedef struct {
+    u8* data;
+    u64 size;
+    u32 cluster_count;
+} Image;
+
+//--------------------------------------------------------------------------------------------------
+
+void image_default_config(ImageConfig* config);
+bool image_generate(const ImageConfig* config, Image* image);
+void image_free(Image* image);
+u8 image_file_byte(u32 file_number, u64 offset);
+
+#endif
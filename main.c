@@ -8,30 +8,8 @@
 #include "disk.h"
 #include "exfat.h"
 #include "cli.h"
-
-//--------------------------------------------------------------------------------------------------
-
-static FILE* filesystem_file;
-
-//--------------------------------------------------------------------------------------------------
-
-static bool disk_read(u32 address, u8* data) {
-    if (fseek(filesystem_file, address * BLOCK_SIZE, SEEK_SET)) {
-        return false;
-    }
-
-    return fread(data, BLOCK_SIZE, 1, filesystem_file) == 1;
-}
-
-//--------------------------------------------------------------------------------------------------
-
-static bool disk_write(u32 address, const u8* data) {
-    if (fseek(filesystem_file, address * BLOCK_SIZE, SEEK_SET)) {
-        return false;
-    }
-
-    return fwrite(data, BLOCK_SIZE, 1, filesystem_file) == 1;
-}
+#include "host.h"
+#include "string.h"
 
 //--------------------------------------------------------------------------------------------------
 
@@ -86,28 +64,50 @@ static void print_file(File* file) {
 
 //--------------------------------------------------------------------------------------------------
 
+// Usage: main <image> [--io-uring | --mmap] [--direct] [--sector-size bytes] [--verify]
 int main(int argument_count, const char** arguments) {
-    assert(argument_count == 2);
-    filesystem_file = fopen(arguments[1], "r+");
-    assert(filesystem_file);
+    assert(argument_count >= 2);
+
+    int mode = HOST_MODE_PREAD;
+    int flags = 0;
+    u32 block_size = 0;
+    int mount_flags = 0;
+
+    for (int i = 2; i < argument_count; i++) {
+        if (strcmp(arguments[i], "--io-uring") == 0) {
+            mode = HOST_MODE_IO_URING;
+        }
+        else if (strcmp(arguments[i], "--mmap") == 0) {
+            mode = HOST_MODE_MMAP;
+        }
+        else if (strcmp(arguments[i], "--direct") == 0) {
+            flags |= HOST_FLAG_DIRECT;
+        }
+        else if (strcmp(arguments[i], "--sector-size") == 0 && i + 1 < argument_count) {
+            block_size = strtoul(arguments[++i], 0, 0);
+        }
+        else if (strcmp(arguments[i], "--verify") == 0) {
+            mount_flags |= EXFAT_MOUNT_VERIFY;
+        }
+    }
+
+    DiskOps ops;
+    assert(host_open(arguments[1], mode, flags, block_size, &ops));
     exfat_init();
 
     int status;
 
-    DiskOps ops = {
-        .read  = disk_read,
-        .write = disk_write,
-    };
+    // Every exFAT partition is mounted, as disk0, disk1 and so on.
+    int volume_count;
+    assert(exfat_mount_all(&ops, "disk", DEFAULT_CACHE_SIZE, mount_flags, &volume_count) == EXFAT_OK);
 
-    Disk disk;
-    assert(disk_read_partitions(&ops, &disk));
-    assert(exfat_mount(&ops, disk.partitions[0].address, "disk0") == EXFAT_OK);
+    cli_init();
 
     while (1) {
         cli_task();
     }
 
-    char volume_label[12];
+    char volume_label[VOLUME_LABEL_SIZE];
     status = exfat_get_volume_label(&dir, "disk0", volume_label);
     printf("Volume label : %s\n", volume_label);
     status = exfat_set_volume_label(&dir, "disk0", "AWEEE");
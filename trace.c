@@ -0,0 +1,191 @@
+// Author: strawberryhacker
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "trace.h"
+#include "time.h"
+#include "stdatomic.h"
+
+//--------------------------------------------------------------------------------------------------
+
+typedef struct {
+    atomic_ullong count;
+    atomic_ullong total_time;
+    atomic_ullong max_time;
+    atomic_ullong buckets[TRACE_BUCKET_COUNT];
+} Histogram;
+
+//--------------------------------------------------------------------------------------------------
+
+static const char* operation_names[TRACE_OPERATION_COUNT] = {
+    [TRACE_MOUNT]             = "mount",
+    [TRACE_OPEN_FILE]         = "open_file",
+    [TRACE_READ_DIRECTORY]    = "read_directory",
+    [TRACE_FILE_READ]         = "file_read",
+    [TRACE_FILE_WRITE]        = "file_write",
+    [TRACE_SET_FILE_OFFSET]   = "set_file_offset",
+    [TRACE_DISK_READ]         = "disk_read",
+    [TRACE_DISK_WRITE]        = "disk_write",
+    [TRACE_DISK_READ_BLOCKS]  = "disk_read_blocks",
+    [TRACE_DISK_WRITE_BLOCKS] = "disk_write_blocks",
+    [TRACE_DISK_MAP]          = "disk_map",
+};
+
+//--------------------------------------------------------------------------------------------------
+
+#ifdef EXFAT_TRACE
+
+// The histograms are shared by every volume, since the disk operations do not know which volume
+// they belong to. They are updated with relaxed atomics.
+static Histogram histograms[TRACE_OPERATION_COUNT];
+
+// Set before the library is used from other threads.
+static TraceCallback trace_callback;
+static void* trace_context;
+
+//--------------------------------------------------------------------------------------------------
+
+static u64 get_time() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (u64)time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static inline int get_bucket(u64 time) {
+    int bucket = (time == 0) ? 0 : 64 - __builtin_clzll(time);
+    return limit(bucket, TRACE_BUCKET_COUNT - 1);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+u64 trace_begin(int operation) {
+    u64 time = get_time();
+
+    if (trace_callback) {
+        trace_callback(operation, true, time, trace_context);
+    }
+
+    return time;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void trace_end(int operation, u64 start) {
+    u64 end = get_time();
+    u64 time = end - start;
+
+    Histogram* histogram = &histograms[operation];
+
+    atomic_fetch_add_explicit(&histogram->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->total_time, time, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->buckets[get_bucket(time)], 1, memory_order_relaxed);
+
+    u64 max = atomic_load_explicit(&histogram->max_time, memory_order_relaxed);
+
+    while (time > max && atomic_compare_exchange_weak_explicit(&histogram->max_time, &max, time, memory_order_relaxed, memory_order_relaxed) == false);
+
+    if (trace_callback) {
+        trace_callback(operation, false, end, trace_context);
+    }
+}
+
+#endif
+
+//--------------------------------------------------------------------------------------------------
+
+bool trace_enabled() {
+#ifdef EXFAT_TRACE
+    return true;
+#else
+    return false;
+#endif
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void trace_set_callback(TraceCallback callback, void* context) {
+#ifdef EXFAT_TRACE
+    trace_callback = callback;
+    trace_context = context;
+#endif
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// The fields are read one at a time, so a histogram read while operations are running might be off
+// by the operations which end during the call.
+bool trace_get_histogram(int operation, TraceHistogram* histogram) {
+#ifdef EXFAT_TRACE
+    if (operation < 0 || operation >= TRACE_OPERATION_COUNT) {
+        return false;
+    }
+
+    Histogram* source = &histograms[operation];
+
+    histogram->count = atomic_load_explicit(&source->count, memory_order_relaxed);
+    histogram->total_time = atomic_load_explicit(&source->total_time, memory_order_relaxed);
+    histogram->max_time = atomic_load_explicit(&source->max_time, memory_order_relaxed);
+
+    for (int i = 0; i < TRACE_BUCKET_COUNT; i++) {
+        histogram->buckets[i] = atomic_load_explicit(&source->buckets[i], memory_order_relaxed);
+    }
+
+    return true;
+#else
+    return false;
+#endif
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void trace_reset() {
+#ifdef EXFAT_TRACE
+    for (int i = 0; i < TRACE_OPERATION_COUNT; i++) {
+        Histogram* histogram = &histograms[i];
+
+        atomic_store_explicit(&histogram->count, 0, memory_order_relaxed);
+        atomic_store_explicit(&histogram->total_time, 0, memory_order_relaxed);
+        atomic_store_explicit(&histogram->max_time, 0, memory_order_relaxed);
+
+        for (int j = 0; j < TRACE_BUCKET_COUNT; j++) {
+            atomic_store_explicit(&histogram->buckets[j], 0, memory_order_relaxed);
+        }
+    }
+#endif
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Returns the upper bound of the bucket holding the percentile, which is at most twice the real
+// value. The slowest bucket is capped by the largest time seen.
+u64 trace_percentile(const TraceHistogram* histogram, int percent) {
+    u64 target = (histogram->count * percent + 99) / 100;
+    u64 seen = 0;
+
+    if (histogram->count == 0) {
+        return 0;
+    }
+
+    for (int i = 0; i < TRACE_BUCKET_COUNT; i++) {
+        seen += histogram->buckets[i];
+
+        if (seen >= target && seen) {
+            u64 bound = (i == 0) ? 0 : (u64)1 << i;
+            return limit(bound, histogram->max_time);
+        }
+    }
+
+    return histogram->max_time;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+const char* trace_operation_name(int operation) {
+    if (operation < 0 || operation >= TRACE_OPERATION_COUNT) {
+        return "unknown";
+    }
+
+    return operation_names[operation];
+}
@@ -0,0 +1,69 @@
+// Author: strawberryhacker
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "utilities.h"
+
+//--------------------------------------------------------------------------------------------------
+
+// Bucket 0 counts operations which took no measurable time, and bucket i those which took from
+// 2^(i-1) up to 2^i nanoseconds. The last bucket also takes everything slower.
+#define TRACE_BUCKET_COUNT  36
+
+//--------------------------------------------------------------------------------------------------
+
+enum {
+    TRACE_MOUNT,
+    TRACE_OPEN_FILE,
+    TRACE_READ_DIRECTORY,
+    TRACE_FILE_READ,
+    TRACE_FILE_WRITE,
+    TRACE_SET_FILE_OFFSET,
+    TRACE_DISK_READ,
+    TRACE_DISK_WRITE,
+    TRACE_DISK_READ_BLOCKS,
+    TRACE_DISK_WRITE_BLOCKS,
+    TRACE_DISK_MAP,
+
+    TRACE_OPERATION_COUNT,
+};
+
+typedef struct {
+    u64 count;
+    u64 total_time;
+    u64 max_time;
+    u64 buckets[TRACE_BUCKET_COUNT];
+} TraceHistogram;
+
+// Called when an operation begins and when it ends, with a monotonic time in nanoseconds. It runs
+// on the thread doing the operation, and might be called from several threads at once.
+typedef void (*TraceCallback)(int operation, bool begin, u64 time, void* context);
+
+//--------------------------------------------------------------------------------------------------
+
+// The hooks are only compiled in when EXFAT_TRACE is defined. Otherwise they are empty and the rest
+// of the calls report that tracing is not available.
+#ifdef EXFAT_TRACE
+
+u64 trace_begin(int operation);
+void trace_end(int operation, u64 start);
+
+#else
+
+static inline u64 trace_begin(int operation) {
+    return 0;
+}
+
+static inline void trace_end(int operation, u64 start) {}
+
+#endif
+
+bool trace_enabled();
+void trace_set_callback(TraceCallback callback, void* context);
+bool trace_get_histogram(int operation, TraceHistogram* histogram);
+void trace_reset();
+u64 trace_percentile(const TraceHistogram* histogram, int percent);
+const char* trace_operation_name(int operation);
+
+#endif
@@ -0,0 +1,179 @@
+// Author: strawberryhacker
+
+#include "unicode.h"
+
+//--------------------------------------------------------------------------------------------------
+
+#define ASCII_BYTES_MASK  0x8080808080808080ULL
+#define ASCII_UNITS_MASK  0xFF80FF80FF80FF80ULL
+
+#define REPLACEMENT_CHARACTER  0xFFFD
+
+//--------------------------------------------------------------------------------------------------
+
+// Names are not aligned inside the directory entries, so words are loaded a byte at a time. This
+// compiles to a single load.
+static inline u64 load_u64(const void* data) {
+    u64 value;
+    __builtin_memcpy(&value, data, sizeof(u64));
+    return value;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+static inline bool is_surrogate(u32 c) {
+    return c >= 0xD800 && c <= 0xDFFF;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// Returns the size of the sequence, or zero if it is not valid. Overlong forms, surrogates and code
+// points above U+10FFFF are rejected.
+static int decode_utf8(const u8* data, int length, u32* code_point) {
+    u8 first = data[0];
+    u32 value;
+    u32 min;
+    int size;
+
+    if (first < 0x80) {
+        *code_point = first;
+        return 1;
+    }
+    else if ((first & 0xE0) == 0xC0) {
+        size = 2;
+        value = first & 0x1F;
+        min = 0x80;
+    }
+    else if ((first & 0xF0) == 0xE0) {
+        size = 3;
+        value = first & 0x0F;
+        min = 0x800;
+    }
+    else if ((first & 0xF8) == 0xF0) {
+        size = 4;
+        value = first & 0x07;
+        min = 0x10000;
+    }
+    else {
+        return 0;
+    }
+
+    if (size > length) {
+        return 0;
+    }
+
+    for (int i = 1; i < size; i++) {
+        if ((data[i] & 0xC0) != 0x80) {
+            return 0;
+        }
+
+        value = (value << 6) | (data[i] & 0x3F);
+    }
+
+    if (value < min || value > 0x10FFFF || is_surrogate(value)) {
+        return 0;
+    }
+
+    *code_point = value;
+    return size;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+int utf8_to_utf16(const char* text, int length, Unicode* output, int max) {
+    const u8* data = (const u8 *)text;
+    int count = 0;
+    int i = 0;
+
+    while (i < length) {
+        // Runs of ASCII are widened eight bytes at a time.
+        if (i + 8 <= length && count + 8 <= max && (load_u64(data + i) & ASCII_BYTES_MASK) == 0) {
+            for (int j = 0; j < 8; j++) {
+                output[count + j] = data[i + j];
+            }
+
+            i += 8;
+            count += 8;
+            continue;
+        }
+
+        u32 code_point;
+        int size = decode_utf8(data + i, length - i, &code_point);
+
+        if (size == 0) {
+            return -1;
+        }
+
+        i += size;
+
+        if (code_point < 0x10000) {
+            if (count == max) {
+                return -1;
+            }
+
+            output[count++] = code_point;
+        }
+        else {
+            if (count + 2 > max) {
+                return -1;
+            }
+
+            code_point -= 0x10000;
+            output[count++] = 0xD800 + (code_point >> 10);
+            output[count++] = 0xDC00 + (code_point & 0x3FF);
+        }
+    }
+
+    return count;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+int utf16_to_utf8(const Unicode* input, int length, char* output) {
+    u8* data = (u8 *)output;
+    int size = 0;
+    int i = 0;
+
+    while (i < length) {
+        // Runs of ASCII are narrowed eight units at a time.
+        if (i + 8 <= length && ((load_u64(input + i) | load_u64(input + i + 4)) & ASCII_UNITS_MASK) == 0) {
+            for (int j = 0; j < 8; j++) {
+                data[size + j] = (u8)input[i + j];
+            }
+
+            i += 8;
+            size += 8;
+            continue;
+        }
+
+        u32 c = input[i++];
+
+        if (c < 0x80) {
+            data[size++] = c;
+        }
+        else if (c < 0x800) {
+            data[size++] = 0xC0 | (c >> 6);
+            data[size++] = 0x80 | (c & 0x3F);
+        }
+        else if (c <= 0xDBFF && c >= 0xD800 && i < length && input[i] >= 0xDC00 && input[i] <= 0xDFFF) {
+            c = 0x10000 + ((c - 0xD800) << 10) + (input[i++] - 0xDC00);
+
+            data[size++] = 0xF0 | (c >> 18);
+            data[size++] = 0x80 | ((c >> 12) & 0x3F);
+            data[size++] = 0x80 | ((c >> 6) & 0x3F);
+            data[size++] = 0x80 | (c & 0x3F);
+        }
+        else {
+            if (is_surrogate(c)) {
+                c = REPLACEMENT_CHARACTER;
+            }
+
+            data[size++] = 0xE0 | (c >> 12);
+            data[size++] = 0x80 | ((c >> 6) & 0x3F);
+            data[size++] = 0x80 | (c & 0x3F);
+        }
+    }
+
+    data[size] = 0;
+    return size;
+}
@@ -0,0 +1,25 @@
+// Author: strawberryhacker
+
+#ifndef UNICODE_H
+#define UNICODE_H
+
+#include "utilities.h"
+
+//--------------------------------------------------------------------------------------------------
+
+// A UTF-16 unit never takes more than three bytes in UTF-8. Surrogate pairs take four bytes for two
+// units.
+#define UTF8_MAX_UNIT_SIZE  3
+
+//--------------------------------------------------------------------------------------------------
+
+// Converts UTF-8 text to UTF-16. Returns the number of units written, or -1 if the text is not
+// valid UTF-8 or needs more than max units.
+int utf8_to_utf16(const char* text, int length, Unicode* output, int max);
+
+// Converts UTF-16 to null terminated UTF-8. Unpaired surrogates are written as U+FFFD. The output
+// must have room for UTF8_MAX_UNIT_SIZE bytes per unit and the terminator. Returns the number of
+// bytes written, not counting the terminator.
+int utf16_to_utf8(const Unicode* input, int length, char* output);
+
+#endif